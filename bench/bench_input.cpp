@@ -0,0 +1,112 @@
+// Compares ways of reading command lines from stdin on a generated input
+// file: getline(cin) with and without stdio sync, and InputReader. Each
+// reader runs in its own child process with the file as stdin and only
+// splits lines, so the numbers are pure input cost. Results go to stderr:
+//
+//     ./bench_input [lines] [--crlf]
+
+#define BOOKSTORE_NO_MAIN
+#include "../main.cpp"
+
+#include <chrono>
+#include <sys/wait.h>
+
+struct Result {
+    long long lines = 0;
+    long long bytes = 0; // line bytes handed to the caller, terminators excluded
+};
+
+static Result readGetline() {
+    Result result;
+    string line;
+    while (getline(cin, line)) {
+        result.lines++;
+        result.bytes += line.size();
+    }
+    return result;
+}
+
+static Result readInputReader() {
+    Result result;
+    InputReader input;
+    string_view line;
+    while (input.next(line)) {
+        result.lines++;
+        result.bytes += line.size();
+    }
+    return result;
+}
+
+// Writes lines commands to path, cycling through typical command shapes
+static long long writeInput(const char* path, int lines, bool crlf) {
+    const char* shapes[] = {
+        "buy 978-%010d 3",
+        "show -ISBN=978-%010d",
+        "select 978-%010d",
+        "modify -name=\"Name_%d\" -keyword=\"k1|k2|k3\" -price=19.99",
+        "su u%d p12345",
+        "logout",
+        "show -keyword=\"k%d\"",
+        "import %d 1234.50",
+    };
+    FILE* file = fopen(path, "w");
+    char line[128];
+    long long size = 0;
+    for (int i = 0; i < lines; i++) {
+        snprintf(line, sizeof(line), shapes[i % 8], i % 100000);
+        size += fprintf(file, "%s%s", line, crlf ? "\r\n" : "\n");
+    }
+    fclose(file);
+    return size;
+}
+
+// Runs read in a child process with path as stdin and reports its speed
+static void measure(const char* label, const char* path, long long fileBytes, bool unsync,
+                    Result (*read)()) {
+    pid_t child = fork();
+    if (child == 0) {
+        int fd = open(path, O_RDONLY);
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+        if (unsync) ios::sync_with_stdio(false);
+        auto start = chrono::steady_clock::now();
+        Result result = read();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "  %-22s %6.3f s %12.0f lines/s %8.1f MiB/s  (%lld lines, %lld bytes)\n",
+                label, seconds, result.lines / seconds, fileBytes / seconds / 1048576.0,
+                result.lines, result.bytes);
+        _exit(0);
+    }
+    waitpid(child, nullptr, 0);
+}
+
+int main(int argc, char* argv[]) {
+    int lines = 5000000;
+    bool crlf = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--crlf") == 0) {
+            crlf = true;
+        } else {
+            lines = atoi(argv[i]);
+        }
+    }
+
+    char path[] = "/tmp/bookstore-input-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        cerr << "cannot create a scratch file" << endl;
+        return 1;
+    }
+    close(fd);
+    long long size = writeInput(path, lines, crlf);
+    fprintf(stderr, "input: %d lines, %.1f MiB, %s line ends\n", lines, size / 1048576.0,
+            crlf ? "CRLF" : "LF");
+
+    // getline keeps the '\r' of CRLF input, so its byte counts differ there
+    measure("getline, stdio sync", path, size, false, readGetline);
+    measure("getline, no sync", path, size, true, readGetline);
+    measure("InputReader", path, size, false, readInputReader);
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,182 @@
+// Compares the byte kernels with the one-character-at-a-time code they
+// replaced, on the inner loops of the hot paths:
+//   - validating command fields (userIDs, ISBNs, book text)
+//   - lower_bound over a full B+ tree node of ISBN and (field, ISBN) keys,
+//     as every show and book lookup does on each level
+//   - scanning an extendible hash bucket of userIDs for an absent key,
+//     as findAccount does on a miss
+// Results go to stderr:
+//
+//     ./bench_kernels [rounds]
+
+#define BOOKSTORE_NO_MAIN
+#include "../main.cpp"
+
+#include <chrono>
+#include <random>
+
+// The validators and key comparisons as they were before the kernels
+namespace reference {
+
+bool isValidUserID(string_view s) {
+    if (s.empty() || s.length() > 30) return false;
+    for (char c : s) {
+        if (!isalnum(c) && c != '_') return false;
+    }
+    return true;
+}
+
+bool isValidISBN(string_view s) {
+    if (s.empty() || s.length() > 20) return false;
+    for (char c : s) {
+        if (c < 33 || c > 126) return false;
+    }
+    return true;
+}
+
+bool isValidBookString(string_view s) {
+    if (s.empty() || s.length() > 60) return false;
+    for (char c : s) {
+        if (c < 33 || c > 126 || c == '"') return false;
+    }
+    return true;
+}
+
+template <size_t N>
+bool less(const FixedString<N>& a, const FixedString<N>& b) {
+    return strcmp(a.data, b.data) < 0;
+}
+
+template <size_t N>
+bool equal(const FixedString<N>& a, const FixedString<N>& b) {
+    return strcmp(a.data, b.data) == 0;
+}
+
+bool less(const BookFieldKey& a, const BookFieldKey& b) {
+    if (equal(a.first, b.first)) return less(a.second, b.second);
+    return less(a.first, b.first);
+}
+
+} // namespace reference
+
+static volatile long long sink;
+
+template <typename Body>
+static double seconds(Body body) {
+    auto start = chrono::steady_clock::now();
+    body();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* workload, long long operations, double before, double after) {
+    fprintf(stderr, "  %-30s %8.1f ns -> %6.1f ns  (%.2fx)\n", workload, before / operations * 1e9,
+            after / operations * 1e9, before / after);
+}
+
+static string randomText(mt19937& rng, const char* alphabet, int minLength, int maxLength) {
+    int length = minLength + rng() % (maxLength - minLength + 1);
+    size_t size = strlen(alphabet);
+    string text;
+    for (int i = 0; i < length; i++) text += alphabet[rng() % size];
+    return text;
+}
+
+template <typename Check>
+static double validate(const vector<string>& inputs, int rounds, Check check) {
+    return seconds([&] {
+        long long valid = 0;
+        for (int r = 0; r < rounds; r++) {
+            for (const string& input : inputs) valid += check(input);
+        }
+        sink = valid;
+    });
+}
+
+template <typename Key, typename Less>
+static double searchNode(const vector<Key>& node, const vector<Key>& probes, int rounds, Less less) {
+    return seconds([&] {
+        long long total = 0;
+        for (int r = 0; r < rounds; r++) {
+            for (const Key& probe : probes) {
+                total += lower_bound(node.begin(), node.end(), probe, less) - node.begin();
+            }
+        }
+        sink = total;
+    });
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? max(1, atoi(argv[1])) : 20;
+    mt19937 rng(1);
+    const char* word = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    const char* visible = "abcdefghijklmnopqrstuvwxyz0123456789-_!#$%&'()*+,./:;<=>?@[]^{}~";
+
+    const int inputCount = 100000;
+    vector<string> userIDs, isbns, texts;
+    for (int i = 0; i < inputCount; i++) {
+        userIDs.push_back(randomText(rng, word, 6, 30));
+        isbns.push_back(randomText(rng, visible, 10, 20));
+        texts.push_back(randomText(rng, visible, 8, 60));
+    }
+
+    fprintf(stderr, "validation, per field\n");
+    long long checks = (long long)inputCount * rounds;
+    report("userID", checks, validate(userIDs, rounds, reference::isValidUserID),
+           validate(userIDs, rounds, isValidUserID));
+    report("ISBN", checks, validate(isbns, rounds, reference::isValidISBN),
+           validate(isbns, rounds, isValidISBN));
+    report("name / author / keyword", checks, validate(texts, rounds, reference::isValidBookString),
+           validate(texts, rounds, isValidBookString));
+
+    // Keys sharing a long prefix, as generated ISBNs and names usually do
+    const int nodeKeys = 100;
+    vector<FixedString<21>> isbnNode, isbnProbes;
+    vector<BookFieldKey> fieldNode, fieldProbes;
+    for (int i = 0; i < nodeKeys; i++) {
+        char isbn[24], name[40];
+        snprintf(isbn, sizeof(isbn), "978-7-%08d", i * 37);
+        snprintf(name, sizeof(name), "The Collected Works, Volume %03d", i / 4);
+        isbnNode.push_back(FixedString<21>(isbn));
+        fieldNode.push_back(BookFieldKey(FixedString<61>(name), FixedString<21>(isbn)));
+    }
+    sort(isbnNode.begin(), isbnNode.end());
+    sort(fieldNode.begin(), fieldNode.end());
+    for (int i = 0; i < 1000; i++) {
+        isbnProbes.push_back(isbnNode[rng() % nodeKeys]);
+        fieldProbes.push_back(fieldNode[rng() % nodeKeys]);
+    }
+
+    fprintf(stderr, "B+ tree node search (%d keys), per lookup\n", nodeKeys);
+    long long lookups = (long long)isbnProbes.size() * rounds * 10;
+    report("ISBN keys", lookups,
+           searchNode(isbnNode, isbnProbes, rounds * 10,
+                      [](const FixedString<21>& a, const FixedString<21>& b) { return reference::less(a, b); }),
+           searchNode(isbnNode, isbnProbes, rounds * 10,
+                      [](const FixedString<21>& a, const FixedString<21>& b) { return a < b; }));
+    report("(field, ISBN) keys", lookups,
+           searchNode(fieldNode, fieldProbes, rounds * 10,
+                      [](const BookFieldKey& a, const BookFieldKey& b) { return reference::less(a, b); }),
+           searchNode(fieldNode, fieldProbes, rounds * 10,
+                      [](const BookFieldKey& a, const BookFieldKey& b) { return a < b; }));
+
+    // A full bucket of userIDs with a common prefix, probed for a missing one
+    const int bucketKeys = 116;
+    vector<FixedString<31>> bucket;
+    for (int i = 0; i < bucketKeys; i++) bucket.push_back(FixedString<31>("customer_" + to_string(i * 7919)));
+    FixedString<31> missing("customer_unknown");
+    long long scans = 100000LL * rounds;
+    auto scan = [&](auto equal) {
+        return seconds([&] {
+            long long found = 0;
+            for (long long s = 0; s < scans; s++) {
+                for (const auto& key : bucket) found += equal(key, missing);
+            }
+            sink = found;
+        });
+    };
+    fprintf(stderr, "hash bucket miss (%d userIDs), per bucket\n", bucketKeys);
+    report("userID keys", scans,
+           scan([](const FixedString<31>& a, const FixedString<31>& b) { return reference::equal(a, b); }),
+           scan([](const FixedString<31>& a, const FixedString<31>& b) { return a == b; }));
+    return 0;
+}
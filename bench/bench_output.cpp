@@ -0,0 +1,94 @@
+// Compares flushing stdout after every line (cout << endl) with OutputBuffer
+// on show-sized and log-sized outputs. Write syscalls are read from
+// /proc/self/io. Run with stdout redirected, results go to stderr:
+//
+//     ./bench_output [rows] > /dev/null
+
+#define BOOKSTORE_NO_MAIN
+#include "../main.cpp"
+
+#include <chrono>
+
+static long long writeSyscalls() {
+    ifstream io("/proc/self/io");
+    string key;
+    long long value;
+    while (io >> key >> value) {
+        if (key == "syscw:") return value;
+    }
+    return -1;
+}
+
+struct Result {
+    double seconds;
+    long long writes;
+};
+
+template <typename Body>
+static Result measure(Body body) {
+    long long writesBefore = writeSyscalls();
+    auto start = chrono::steady_clock::now();
+    body();
+    auto end = chrono::steady_clock::now();
+    return {chrono::duration<double>(end - start).count(), writeSyscalls() - writesBefore};
+}
+
+static void report(const string& workload, int rows, const Result& flushed, const Result& buffered) {
+    cerr << workload << " (" << rows << " rows)\n"
+         << "  endl per line: " << fixed << setprecision(3) << flushed.seconds << " s, "
+         << flushed.writes << " write syscalls, " << setprecision(0) << rows / flushed.seconds
+         << " rows/s\n"
+         << "  OutputBuffer:  " << setprecision(3) << buffered.seconds << " s, "
+         << buffered.writes << " write syscalls, " << setprecision(0) << rows / buffered.seconds
+         << " rows/s\n";
+}
+
+int main(int argc, char* argv[]) {
+    int rows = argc > 1 ? atoi(argv[1]) : 100000;
+
+    vector<Book> books(1000);
+    for (size_t i = 0; i < books.size(); i++) {
+        Book& book = books[i];
+        snprintf(book.ISBN, sizeof(book.ISBN), "978-%010zu", i);
+        snprintf(book.name, sizeof(book.name), "Book number %zu", i);
+        snprintf(book.author, sizeof(book.author), "Author %zu", i % 97);
+        snprintf(book.keyword, sizeof(book.keyword), "k%zu|k%zu", i % 13, i % 31);
+        book.price = Money(1025 + 100 * i);
+        book.quantity = i * 7;
+    }
+    string logLine = "[42] employee_07 {3} import 978-0000000042 x100 cost 1234.50";
+
+    Result flushed = measure([&] {
+        for (int i = 0; i < rows; i++) {
+            const Book& book = books[i % books.size()];
+            cout << book.ISBN << "\t" << book.name << "\t" << book.author << "\t"
+                 << book.keyword << "\t" << book.price.cents / 100 << "." << setw(2)
+                 << setfill('0') << book.price.cents % 100 << setfill(' ') << "\t"
+                 << book.quantity << endl;
+        }
+    });
+    Result buffered = measure([&] {
+        OutputBuffer out;
+        for (int i = 0; i < rows; i++) {
+            const Book& book = books[i % books.size()];
+            out << book.ISBN << '\t' << book.name << '\t' << book.author << '\t'
+                << book.keyword << '\t' << book.price << '\t' << book.quantity << '\n';
+        }
+    });
+    report("show", rows, flushed, buffered);
+
+    flushed = measure([&] {
+        for (int i = 0; i < rows; i++) {
+            cout << logLine << endl;
+        }
+    });
+    buffered = measure([&] {
+        OutputBuffer out;
+        for (int i = 0; i < rows; i++) {
+            out << logLine << '\n';
+        }
+    });
+    report("log", rows, flushed, buffered);
+
+    return 0;
+}
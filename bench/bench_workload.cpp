@@ -0,0 +1,317 @@
+// Generates a valid command stream of configurable size and mix, runs it
+// through BookstoreSystem in a scratch directory and reports throughput,
+// p50/p99 latency per command keyword and the file I/O of each phase.
+// Results go to stderr; the command responses are discarded.
+//
+//     ./bench_workload [--books N] [--accounts N] [--commands N] [--seed N]
+//                      [--mix buy=30,show=20,...] [--emit] [--keep]
+//
+// The setup phase logs in as root, creates the accounts with useradd and
+// the books with select/modify/import. The measured phase then draws
+// commands from the mix. Keys are su, register, show, buy, select, modify,
+// import and finance. su is followed by logout, and modify and import are
+// preceded by the select they need; those lines are timed under their own
+// keywords. --emit prints both phases to stdout instead of running them,
+// for feeding to ./code.
+
+#define BOOKSTORE_NO_MAIN
+#include "../main.cpp"
+
+#include <chrono>
+#include <dirent.h>
+#include <memory>
+#include <random>
+#include <sys/stat.h>
+
+struct Options {
+    int books = 20000;
+    int accounts = 5000;
+    int commands = 100000;
+    unsigned seed = 1;
+    vector<pair<string, int>> mix = {{"su", 5},      {"register", 3}, {"show", 25},
+                                     {"buy", 30},    {"select", 10},  {"modify", 10},
+                                     {"import", 10}, {"finance", 7}};
+    bool emit = false;
+    bool keep = false;
+};
+
+class WorkloadGenerator {
+private:
+    const Options& options;
+    mt19937_64 rng;
+    int registered = 0;
+
+    int uniform(int n) {
+        return uniform_int_distribution<int>(0, n - 1)(rng);
+    }
+
+    static string isbn(int i) {
+        char text[24];
+        snprintf(text, sizeof(text), "978-%010d", i);
+        return text;
+    }
+
+    static string keywords(int i) {
+        return "k" + to_string(i % 1000) + "|k" + to_string(i * 7 % 1000 + 1000);
+    }
+
+    string price() {
+        return to_string(100 + uniform(20000) / 100) + "." + to_string(10 + uniform(90));
+    }
+
+    string randomBook() {
+        return isbn(uniform(options.books));
+    }
+
+    void emitShow(vector<string>& out) {
+        int i = uniform(options.books);
+        switch (uniform(5)) {
+            case 0: out.push_back("show -ISBN=" + isbn(i)); break;
+            case 1: out.push_back("show -name=\"Name_" + to_string(i) + "\""); break;
+            case 2: out.push_back("show -author=\"Author_" + to_string(i % 500) + "\""); break;
+            case 3: out.push_back("show -keyword=\"k" + to_string(i % 1000) + "\""); break;
+            default:
+                // A full listing costs O(books); keep it rare
+                out.push_back(uniform(100) == 0 ? "show" : "show -ISBN=" + isbn(i));
+                break;
+        }
+    }
+
+public:
+    WorkloadGenerator(const Options& options) : options(options), rng(options.seed) {}
+
+    vector<string> setup() {
+        vector<string> out = {"su root sjtu"};
+        for (int i = 0; i < options.accounts; i++) {
+            out.push_back("useradd u" + to_string(i) + " p" + to_string(i) + " " +
+                          (i % 4 == 0 ? "3" : "1") + " user" + to_string(i));
+        }
+        for (int i = 0; i < options.books; i++) {
+            out.push_back("select " + isbn(i));
+            out.push_back("modify -name=\"Name_" + to_string(i) + "\" -author=\"Author_" +
+                          to_string(i % 500) + "\" -keyword=\"" + keywords(i) + "\" -price=" + price());
+            out.push_back("import 1000 " + price());
+        }
+        return out;
+    }
+
+    vector<string> commands() {
+        int total = 0;
+        for (const auto& entry : options.mix) total += entry.second;
+
+        vector<string> out;
+        for (int n = 0; n < options.commands; n++) {
+            int pick = uniform(total);
+            string kind;
+            for (const auto& entry : options.mix) {
+                if (pick < entry.second) {
+                    kind = entry.first;
+                    break;
+                }
+                pick -= entry.second;
+            }
+
+            if (kind == "su") {
+                int i = uniform(max(options.accounts, 1));
+                out.push_back("su u" + to_string(i) + " p" + to_string(i));
+                out.push_back("logout");
+            } else if (kind == "register") {
+                int i = registered++;
+                out.push_back("register r" + to_string(i) + " pw reader" + to_string(i));
+            } else if (kind == "show") {
+                emitShow(out);
+            } else if (kind == "buy") {
+                out.push_back("buy " + randomBook() + " " + to_string(1 + uniform(3)));
+            } else if (kind == "select") {
+                out.push_back("select " + randomBook());
+            } else if (kind == "modify") {
+                out.push_back("select " + randomBook());
+                out.push_back("modify -price=" + price());
+            } else if (kind == "import") {
+                out.push_back("select " + randomBook());
+                out.push_back("import " + to_string(1 + uniform(100)) + " " + price());
+            } else {
+                out.push_back(uniform(2) ? "show finance" : "show finance " + to_string(1 + uniform(50)));
+            }
+        }
+        return out;
+    }
+};
+
+// Counters from /proc/self/io
+struct ProcessIo {
+    long long rchar = 0, wchar = 0, syscr = 0, syscw = 0;
+
+    static ProcessIo now() {
+        ProcessIo io;
+        ifstream file("/proc/self/io");
+        string key;
+        long long value;
+        while (file >> key >> value) {
+            if (key == "rchar:") io.rchar = value;
+            if (key == "wchar:") io.wchar = value;
+            if (key == "syscr:") io.syscr = value;
+            if (key == "syscw:") io.syscw = value;
+        }
+        return io;
+    }
+};
+
+// Bytes written to stdout so far; stdout is redirected to a scratch file
+static long long stdoutBytes() {
+    struct stat info;
+    return fstat(STDOUT_FILENO, &info) == 0 ? info.st_size : 0;
+}
+
+// Label under which a command line is timed
+static string labelOf(const string& line) {
+    string_view view = trim(line);
+    string_view keyword = view.substr(0, view.find(' '));
+    if (keyword == "show" && view.substr(keyword.size()).find("finance") != string_view::npos) {
+        return "show finance";
+    }
+    return string(keyword);
+}
+
+struct PhaseResult {
+    double seconds = 0;
+    long long readBytes = 0, writtenBytes = 0, readCalls = 0, writeCalls = 0;
+    map<string, vector<double>> latencies; // microseconds per label
+};
+
+static PhaseResult runPhase(BookstoreSystem& system, const vector<string>& lines) {
+    PhaseResult result;
+    ProcessIo before = ProcessIo::now();
+    long long outputBefore = stdoutBytes();
+    auto start = chrono::steady_clock::now();
+    for (const string& line : lines) {
+        auto begin = chrono::steady_clock::now();
+        system.processCommand(line);
+        auto end = chrono::steady_clock::now();
+        result.latencies[labelOf(line)].push_back(chrono::duration<double, micro>(end - begin).count());
+    }
+    system.flushOutput();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    ProcessIo after = ProcessIo::now();
+    result.readBytes = after.rchar - before.rchar;
+    result.writtenBytes = after.wchar - before.wchar - (stdoutBytes() - outputBefore);
+    result.readCalls = after.syscr - before.syscr;
+    result.writeCalls = after.syscw - before.syscw;
+    return result;
+}
+
+static double percentile(vector<double>& sorted, double p) {
+    size_t index = min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[index];
+}
+
+static void report(const string& phase, PhaseResult& result) {
+    size_t total = 0;
+    for (const auto& entry : result.latencies) total += entry.second.size();
+
+    fprintf(stderr, "%s: %zu commands in %.2f s (%.0f commands/s)\n", phase.c_str(), total,
+            result.seconds, total / result.seconds);
+    fprintf(stderr, "  %-14s %9s %11s %10s %10s %10s\n", "command", "count", "commands/s", "p50 us",
+            "p99 us", "max us");
+    for (auto& entry : result.latencies) {
+        vector<double>& sorted = entry.second;
+        sort(sorted.begin(), sorted.end());
+        double sum = 0;
+        for (double latency : sorted) sum += latency;
+        fprintf(stderr, "  %-14s %9zu %11.0f %10.1f %10.1f %10.1f\n", entry.first.c_str(), sorted.size(),
+                sorted.size() / (sum / 1e6), percentile(sorted, 0.50), percentile(sorted, 0.99),
+                sorted.back());
+    }
+    fprintf(stderr, "  file I/O: %.2f MiB read in %lld calls, %.2f MiB written in %lld calls\n",
+            result.readBytes / 1048576.0, result.readCalls, result.writtenBytes / 1048576.0,
+            result.writeCalls);
+}
+
+static bool parseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--emit") {
+            options.emit = true;
+        } else if (arg == "--keep") {
+            options.keep = true;
+        } else if (arg == "--books" && hasValue) {
+            options.books = max(1, atoi(argv[++i]));
+        } else if (arg == "--accounts" && hasValue) {
+            options.accounts = max(0, atoi(argv[++i]));
+        } else if (arg == "--commands" && hasValue) {
+            options.commands = max(0, atoi(argv[++i]));
+        } else if (arg == "--seed" && hasValue) {
+            options.seed = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--mix" && hasValue) {
+            options.mix.clear();
+            for (const string& item : split(argv[++i], ',')) {
+                size_t eq = item.find('=');
+                if (eq == string::npos) return false;
+                options.mix.push_back({item.substr(0, eq), atoi(item.c_str() + eq + 1)});
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        cerr << "usage: " << argv[0]
+             << " [--books N] [--accounts N] [--commands N] [--seed N] [--mix key=weight,...]"
+                " [--emit] [--keep]"
+             << endl;
+        return 1;
+    }
+
+    WorkloadGenerator generator(options);
+    vector<string> setup = generator.setup();
+    vector<string> commands = generator.commands();
+    if (options.emit) {
+        for (const string& line : setup) cout << line << '\n';
+        for (const string& line : commands) cout << line << '\n';
+        return 0;
+    }
+
+    char dir[] = "/tmp/bookstore-bench-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        cerr << "cannot create a scratch directory" << endl;
+        return 1;
+    }
+    if (!freopen("responses.txt", "w", stdout)) {
+        cerr << "cannot redirect stdout" << endl;
+        return 1;
+    }
+    unlink("responses.txt");
+
+    fprintf(stderr, "workload: %d books, %d accounts, %d commands, seed %u, data in %s\n",
+            options.books, options.accounts, options.commands, options.seed, dir);
+    auto system = make_unique<BookstoreSystem>();
+    PhaseResult setupResult = runPhase(*system, setup);
+    report("setup", setupResult);
+    PhaseResult measured = runPhase(*system, commands);
+    report("measured", measured);
+
+    auto start = chrono::steady_clock::now();
+    system.reset();
+    auto stopped = chrono::steady_clock::now();
+    system = make_unique<BookstoreSystem>();
+    auto restarted = chrono::steady_clock::now();
+    system.reset();
+    fprintf(stderr, "shutdown: %.3f s, restart: %.3f s\n",
+            chrono::duration<double>(stopped - start).count(),
+            chrono::duration<double>(restarted - stopped).count());
+
+    if (!options.keep) {
+        DIR* files = opendir(".");
+        while (dirent* entry = readdir(files)) {
+            if (entry->d_name[0] != '.') unlink(entry->d_name);
+        }
+        closedir(files);
+        if (chdir("/") == 0) rmdir(dir);
+    }
+    return 0;
+}
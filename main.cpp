@@ -1,6 +1,8 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <cstring>
 #include <vector>
 #include <algorithm>
@@ -8,14 +10,150 @@
 #include <sstream>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
+// ==================== Byte Kernels ====================
+
+// Character-class checks and fixed-width key comparisons. With SSE2 they
+// work on 16 bytes at a time; the scalar versions are the fallback and
+// the reference the benchmarks compare against.
+
+struct ByteRange {
+    unsigned char lo, hi;
+};
+
+// Bytes in any of the ranges or equal to extra, except banned. filler is a
+// member of the class used to pad a partial block.
+struct CharClass {
+    ByteRange ranges[3];
+    int rangeCount;
+    char extra;  // 0 if none
+    char banned; // 0 if none
+    char filler;
+};
+
+constexpr CharClass VISIBLE_CHARS = {{{33, 126}}, 1, 0, 0, 'a'};
+constexpr CharClass BOOK_TEXT_CHARS = {{{33, 126}}, 1, 0, '"', 'a'};
+constexpr CharClass WORD_CHARS = {{{'0', '9'}, {'A', 'Z'}, {'a', 'z'}}, 3, '_', 0, 'a'};
+constexpr CharClass DIGIT_CHARS = {{{'0', '9'}}, 1, 0, 0, '0'};
+
+bool allOfScalar(const CharClass& cls, string_view s) {
+    for (char c : s) {
+        unsigned char u = c;
+        bool ok = cls.extra && c == cls.extra;
+        for (int i = 0; i < cls.rangeCount && !ok; i++) {
+            ok = u >= cls.ranges[i].lo && u <= cls.ranges[i].hi;
+        }
+        if (!ok || (cls.banned && c == cls.banned)) return false;
+    }
+    return true;
+}
+
+// Compares zero-padded keys of N bytes; the order matches strcmp
+template <size_t N>
+int compareFixedScalar(const char* a, const char* b) {
+    return memcmp(a, b, N);
+}
+
+#ifdef __SSE2__
+// Mask of the bytes of v that lie in range. SSE2 compares bytes as signed,
+// so both sides are shifted by 0x80 first.
+inline __m128i bytesInRange(__m128i v, ByteRange range) {
+    __m128i flip = _mm_set1_epi8((char)0x80);
+    __m128i x = _mm_xor_si128(v, flip);
+    __m128i lo = _mm_set1_epi8((char)(range.lo ^ 0x80));
+    __m128i hi = _mm_set1_epi8((char)(range.hi ^ 0x80));
+    return _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi8(lo, x), _mm_cmpgt_epi8(x, hi)),
+                            _mm_set1_epi8((char)0xff));
+}
+
+template <const CharClass& cls>
+inline bool blockInClass(__m128i v) {
+    __m128i ok = cls.extra ? _mm_cmpeq_epi8(v, _mm_set1_epi8(cls.extra)) : _mm_setzero_si128();
+    for (int i = 0; i < cls.rangeCount; i++) ok = _mm_or_si128(ok, bytesInRange(v, cls.ranges[i]));
+    if (cls.banned) ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(cls.banned)), ok);
+    return _mm_movemask_epi8(ok) == 0xffff;
+}
+
+// True if every byte of s is in cls. A view of 16 bytes or more ends with
+// a block loaded at its last 16 bytes; a shorter one is padded with filler.
+template <const CharClass& cls>
+bool allOf(string_view s) {
+    const char* p = s.data();
+    size_t n = s.length();
+    if (n < 16) {
+        char block[16];
+        memset(block, cls.filler, sizeof(block));
+        if (n > 0) memcpy(block, p, n);
+        return blockInClass<cls>(_mm_loadu_si128((const __m128i*)block));
+    }
+    for (size_t i = 0; i + 16 < n; i += 16) {
+        if (!blockInClass<cls>(_mm_loadu_si128((const __m128i*)(p + i)))) return false;
+    }
+    return blockInClass<cls>(_mm_loadu_si128((const __m128i*)(p + n - 16)));
+}
+
+// The last block is loaded at N - 16 and may overlap the one before it
+template <size_t N>
+int compareFixed(const char* a, const char* b) {
+    if constexpr (N < 16) {
+        return compareFixedScalar<N>(a, b);
+    } else {
+        for (size_t i = 0;; i += 16) {
+            if (i > N - 16) i = N - 16;
+            __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+            __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+            unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+            if (diff) {
+                int at = i + __builtin_ctz(diff);
+                return (unsigned char)a[at] - (unsigned char)b[at];
+            }
+            if (i == N - 16) return 0;
+        }
+    }
+}
+#else
+template <const CharClass& cls>
+bool allOf(string_view s) {
+    return allOfScalar(cls, s);
+}
+
+template <size_t N>
+int compareFixed(const char* a, const char* b) {
+    return compareFixedScalar<N>(a, b);
+}
+#endif
+
+
 // ==================== Utility Functions ====================
 
-string trim(const string& str) {
+// 32-bit FNV-1a over size bytes. Pass an earlier result as h to continue
+// the hash over another range.
+unsigned int fnv1a(const void* data, size_t size, unsigned int h = 2166136261u) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    return h;
+}
+
+string_view trim(string_view str) {
     size_t first = str.find_first_not_of(' ');
-    if (first == string::npos) return "";
+    if (first == string_view::npos) return string_view();
     size_t last = str.find_last_not_of(' ');
     return str.substr(first, last - first + 1);
 }
@@ -30,101 +168,124 @@ vector<string> split(const string& str, char delim) {
     return result;
 }
 
-bool isValidUserID(const string& s) {
-    if (s.empty() || s.length() > 30) return false;
-    for (char c : s) {
-        if (!isalnum(c) && c != '_') return false;
-    }
-    return true;
+bool isValidUserID(string_view s) {
+    return !s.empty() && s.length() <= 30 && allOf<WORD_CHARS>(s);
 }
 
-bool isValidPassword(const string& s) {
-    if (s.empty() || s.length() > 30) return false;
-    for (char c : s) {
-        if (!isalnum(c) && c != '_') return false;
-    }
-    return true;
+bool isValidPassword(string_view s) {
+    return !s.empty() && s.length() <= 30 && allOf<WORD_CHARS>(s);
 }
 
-bool isValidUsername(const string& s) {
-    if (s.empty() || s.length() > 30) return false;
-    for (char c : s) {
-        if (c < 33 || c > 126) return false;
-    }
-    return true;
+bool isValidUsername(string_view s) {
+    return !s.empty() && s.length() <= 30 && allOf<VISIBLE_CHARS>(s);
 }
 
-bool isValidISBN(const string& s) {
-    if (s.empty() || s.length() > 20) return false;
-    for (char c : s) {
-        if (c < 33 || c > 126) return false;
-    }
-    return true;
+bool isValidISBN(string_view s) {
+    return !s.empty() && s.length() <= 20 && allOf<VISIBLE_CHARS>(s);
 }
 
-bool isValidBookString(const string& s) {
-    if (s.empty() || s.length() > 60) return false;
-    for (char c : s) {
-        if (c < 33 || c > 126 || c == '"') return false;
-    }
-    return true;
+bool isValidBookString(string_view s) {
+    return !s.empty() && s.length() <= 60 && allOf<BOOK_TEXT_CHARS>(s);
 }
 
-bool isValidKeyword(const string& s) {
-    if (s.empty() || s.length() > 60) return false;
-    vector<string> parts = split(s, '|');
-    set<string> unique_check;
-    for (const string& part : parts) {
-        if (part.empty()) return false;
-        if (unique_check.count(part)) return false;
-        unique_check.insert(part);
-        for (char c : part) {
-            if (c < 33 || c > 126 || c == '"') return false;
-        }
+// Keyword segments are split on '|' like split(), so a single trailing '|'
+// ends the last segment rather than starting an empty one
+bool isValidKeyword(string_view s) {
+    if (!isValidBookString(s)) return false;
+
+    string_view segments[30];
+    int count = 0;
+    size_t start = 0;
+    while (start < s.length()) {
+        size_t end = s.find('|', start);
+        if (end == string_view::npos) end = s.length();
+        string_view segment = s.substr(start, end - start);
+        if (segment.empty()) return false;
+        for (int i = 0; i < count; i++) {
+            if (segments[i] == segment) return false;
+        }
+        segments[count++] = segment;
+        start = end + 1;
     }
     return true;
 }
 
-bool isValidQuantity(const string& s) {
+bool isValidQuantity(string_view s) {
     if (s.empty() || s.length() > 10) return false;
     if (s[0] == '0' && s.length() > 1) return false;
-    for (char c : s) {
-        if (!isdigit(c)) return false;
-    }
-    return true;
+    return allOf<DIGIT_CHARS>(s);
 }
 
-bool isValidPrice(const string& s) {
+bool isValidPrice(string_view s) {
     if (s.empty() || s.length() > 13) return false;
     size_t dotPos = s.find('.');
 
-    if (dotPos == string::npos) {
+    if (dotPos == string_view::npos) {
         // No decimal point - must be all digits
-        for (char c : s) {
-            if (!isdigit(c)) return false;
-        }
-        return true;
+        return allOf<DIGIT_CHARS>(s);
     }
 
     // Has decimal point
     if (dotPos == 0) return false; // Can't start with '.'
     if (dotPos == s.length() - 1) return false; // Can't end with '.'
-    if (s.find('.', dotPos + 1) != string::npos) return false; // Multiple dots
 
-    // Check all chars except dot are digits
-    for (size_t i = 0; i < s.length(); i++) {
-        if (i != dotPos && !isdigit(s[i])) return false;
-    }
+    // Digits on both sides; a second dot fails the check
+    return allOf<DIGIT_CHARS>(s.substr(0, dotPos)) && allOf<DIGIT_CHARS>(s.substr(dotPos + 1));
+}
 
-    return true;
+long long parseQuantity(string_view s) {
+    long long value = 0;
+    from_chars(s.data(), s.data() + s.length(), value);
+    return value;
 }
 
-long long parseQuantity(const string& s) {
-    return stoll(s);
+// Amount of money as a whole number of cents, so sums are exact
+struct Money {
+    long long cents;
+
+    Money() : cents(0) {}
+
+    explicit Money(long long cents) : cents(cents) {}
+
+    Money operator+(Money other) const {
+        return Money(cents + other.cents);
+    }
+
+    Money operator-(Money other) const {
+        return Money(cents - other.cents);
+    }
+
+    // Sets result to this amount times count. Returns false, leaving
+    // result unspecified, if the product does not fit in a Money.
+    bool times(long long count, Money& result) const {
+        return !__builtin_mul_overflow(cents, count, &result.cents);
+    }
+
+    Money& operator+=(Money other) {
+        cents += other.cents;
+        return *this;
+    }
+};
+
+// Parses a string accepted by isValidPrice, rounding to the nearest cent
+Money parsePrice(string_view s) {
+    size_t dot = min(s.find('.'), s.length());
+    long long cents = 0;
+    for (size_t i = 0; i < dot; i++) {
+        cents = cents * 10 + (s[i] - '0');
+    }
+    for (size_t i = dot + 1; i <= dot + 2; i++) {
+        cents = cents * 10 + (i < s.length() ? s[i] - '0' : 0);
+    }
+    if (dot + 3 < s.length() && s[dot + 3] >= '5') cents++;
+    return Money(cents);
 }
 
-double parsePrice(const string& s) {
-    return stod(s);
+// Copies s into a zero-padded fixed-width field, truncating if needed
+template <size_t N>
+void copyField(char (&field)[N], string_view s) {
+    memset(field, 0, N);
+    if (!s.empty()) memcpy(field, s.data(), min(s.length(), N - 1));
 }
 
 // ==================== Data Structures ====================
@@ -148,7 +309,7 @@ struct Book {
     char name[61];
     char author[61];
     char keyword[61];
-    double price;
+    Money price;
     long long quantity;
 
     Book() {
@@ -156,491 +317,2895 @@ struct Book {
         memset(name, 0, sizeof(name));
         memset(author, 0, sizeof(author));
         memset(keyword, 0, sizeof(keyword));
-        price = 0.0;
         quantity = 0;
     }
-};
+};
+
+// The part of a Book stored in books.dat: the key and the fields that stock
+// changes and prices touch. Name, author and keyword are kept in a separate
+// text heap as "name\0author\0keyword\0" starting at textOffset.
+struct BookRecord {
+    char ISBN[21];
+    Money price;
+    long long quantity;
+    long long textOffset;
+    int textLength;   // 0 if every text field is empty
+    int textCapacity; // bytes reserved at textOffset
+
+    BookRecord() {
+        memset(ISBN, 0, sizeof(ISBN));
+        quantity = 0;
+        textOffset = 0;
+        textLength = 0;
+        textCapacity = 0;
+    }
+};
+
+struct Transaction {
+    Money amount;
+    int type; // 1: income, -1: expenditure
+    // Running totals over every transaction up to and including this one
+    Money totalIncome;
+    Money totalExpenditure;
+};
+
+// Sales and imports of one book, or of the whole store
+struct FinanceRecord {
+    long long unitsSold;
+    Money revenue;
+    long long unitsImported;
+    Money importCost;
+
+    FinanceRecord() : unitsSold(0), unitsImported(0) {}
+};
+
+// One entry of the operation log. The entries of each operator are chained
+// newest first through previousByUser.
+struct OpRecord {
+    long long sequence; // 1-based position in the log
+    char userID[31];    // operator, empty if nobody was logged in
+    int privilege;
+    int opcode;         // Command performed
+    char target[31];    // account acted on by account commands
+    char ISBN[21];
+    long long quantity;
+    Money amount;
+    int previousByUser; // index of the operator's previous entry, -1 if none
+    int grantedPrivilege; // privilege useradd gave to target
+
+    OpRecord() {
+        sequence = 0;
+        memset(userID, 0, sizeof(userID));
+        privilege = 0;
+        opcode = 0;
+        memset(target, 0, sizeof(target));
+        memset(ISBN, 0, sizeof(ISBN));
+        quantity = 0;
+        previousByUser = -1;
+        grantedPrivilege = 0;
+    }
+};
+
+// Operator index value: the operator's newest log entry and the privilege
+// it was made with
+struct OperatorEntry {
+    int latest;
+    int privilege;
+};
+
+// Zero-padded fixed-width string, used as an on-disk index key. Every byte
+// after the text is zero, so keys compare as whole arrays.
+template <size_t N>
+struct FixedString {
+    char data[N];
+
+    FixedString() {
+        memset(data, 0, N);
+    }
+
+    FixedString(string_view s) {
+        memset(data, 0, N);
+        memcpy(data, s.data(), min(s.length(), N - 1));
+    }
+
+    FixedString(const char* s) : FixedString(string_view(s)) {}
+
+    FixedString(const string& s) : FixedString(string_view(s)) {}
+
+    // Negative, zero or positive as this sorts before, with or after other
+    int compare(const FixedString& other) const {
+        return compareFixed<N>(data, other.data);
+    }
+
+    bool operator<(const FixedString& other) const {
+        return compareFixed<N>(data, other.data) < 0;
+    }
+
+    bool operator==(const FixedString& other) const {
+        return compareFixed<N>(data, other.data) == 0;
+    }
+
+    // FNV-1a, stable across runs so it can address on-disk buckets
+    unsigned int hash() const {
+        return fnv1a(data, strnlen(data, N));
+    }
+};
+
+// Composite index key ordered by first, then second
+template <typename A, typename B>
+struct PairKey {
+    A first;
+    B second;
+
+    PairKey() {}
+
+    PairKey(const A& first, const B& second) : first(first), second(second) {}
+
+    bool operator<(const PairKey& other) const {
+        int order = first.compare(other.first);
+        if (order != 0) return order < 0;
+        return second < other.second;
+    }
+
+    bool operator==(const PairKey& other) const {
+        return first == other.first && second == other.second;
+    }
+};
+
+// ==================== Instrumentation ====================
+
+// File activity of the whole process. The storage code bumps these on every
+// open, read and write; they are plain additions, so they stay on always.
+struct IoCounters {
+    long long bytesRead = 0;
+    long long bytesWritten = 0;
+    long long fileOpens = 0;
+};
+
+IoCounters ioCounters;
+
+// Calls, latency and file activity per command keyword. Collection is
+// enabled by setting the BOOKSTORE_STATS environment variable; when it is
+// off, measuring a command costs one branch.
+class CommandStats {
+private:
+    struct Entry {
+        long long calls = 0;
+        long long totalNanos = 0;
+        long long maxNanos = 0;
+        long long bytesRead = 0;
+        long long bytesWritten = 0;
+        long long fileOpens = 0;
+    };
+
+    bool enabled;
+    map<string, Entry, less<>> entries;
+
+public:
+    // State captured when a command starts
+    struct Start {
+        chrono::steady_clock::time_point time;
+        IoCounters io;
+    };
+
+    CommandStats() : enabled(getenv("BOOKSTORE_STATS") != nullptr) {}
+
+    bool isEnabled() const {
+        return enabled;
+    }
+
+    Start begin() const {
+        if (!enabled) return Start();
+        return Start{chrono::steady_clock::now(), ioCounters};
+    }
+
+    // Charges everything since start to the command keyword
+    void end(string_view keyword, const Start& start) {
+        if (!enabled) return;
+        long long nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start.time).count();
+        auto it = entries.find(keyword);
+        if (it == entries.end()) it = entries.emplace(string(keyword), Entry()).first;
+        Entry& entry = it->second;
+        entry.calls++;
+        entry.totalNanos += nanos;
+        entry.maxNanos = max(entry.maxNanos, nanos);
+        entry.bytesRead += ioCounters.bytesRead - start.io.bytesRead;
+        entry.bytesWritten += ioCounters.bytesWritten - start.io.bytesWritten;
+        entry.fileOpens += ioCounters.fileOpens - start.io.fileOpens;
+    }
+
+    // One line per keyword, in keyword order
+    string summary() const {
+        string text;
+        char line[160];
+        snprintf(line, sizeof(line), "%-10s %10s %12s %10s %14s %14s %6s\n", "command", "calls",
+                 "total ms", "max us", "bytes read", "bytes written", "opens");
+        text += line;
+        for (const auto& [keyword, entry] : entries) {
+            snprintf(line, sizeof(line), "%-10s %10lld %12.3f %10.1f %14lld %14lld %6lld\n", keyword.c_str(),
+                     entry.calls, entry.totalNanos / 1e6, entry.maxNanos / 1e3, entry.bytesRead,
+                     entry.bytesWritten, entry.fileOpens);
+            text += line;
+        }
+        return text;
+    }
+};
+
+// ==================== Write-Ahead Log ====================
+
+// Record files whose writes go through the log
+enum LogTag {
+    LOG_END_COMMAND = 0,
+    LOG_ACCOUNTS = 1,
+    LOG_BOOKS = 2,
+    LOG_TRANSACTIONS = 3,
+    LOG_BOOK_TEXT = 4,
+    LOG_OPERATIONS = 5,
+    LOG_FINANCE = 6
+};
+
+// Redo log of record writes. Every entry carries the new image of a byte
+// range of one record slot, so replaying an entry more than once is
+// harmless. Entries are buffered in memory and committed in groups:
+// commit() makes every finished command durable with one write and one
+// fsync. A checkpoint brings the data files up to date, after which the log
+// is emptied.
+class WriteAheadLog {
+private:
+    struct EntryHeader {
+        int tag;
+        int index;
+        int offset; // where the image starts within the record
+        int size;   // bytes of image following the header
+        unsigned int checksum;
+    };
+
+    int fd;
+    vector<char> pending;
+    size_t finished; // leading bytes of pending that belong to whole commands
+    size_t fileSize;
+
+    // FNV-1a over the header fields and the image, to spot a torn tail
+    static unsigned int checksum(const EntryHeader& header, const char* image) {
+        return fnv1a(image, header.size, fnv1a(&header, offsetof(EntryHeader, checksum)));
+    }
+
+public:
+    WriteAheadLog(const string& filename) : finished(0) {
+        fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            cerr << "cannot open " << filename << endl;
+            abort();
+        }
+        ioCounters.fileOpens++;
+        fileSize = lseek(fd, 0, SEEK_END);
+    }
+
+    ~WriteAheadLog() {
+        close(fd);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Bytes in the log file, zero right after a checkpoint
+    size_t size() const {
+        return fileSize;
+    }
+
+    // Records the new image of size bytes at offset within record index of
+    // the file tagged tag
+    void log(int tag, int index, int offset, const void* image, int size) {
+        EntryHeader header{tag, index, offset, size, 0};
+        header.checksum = checksum(header, (const char*)image);
+        const char* bytes = (const char*)&header;
+        pending.insert(pending.end(), bytes, bytes + sizeof(EntryHeader));
+        pending.insert(pending.end(), (const char*)image, (const char*)image + size);
+    }
+
+    // Closes the entries of the current command. Only whole commands are
+    // committed and replayed.
+    void endCommand() {
+        if (pending.size() == finished) return;
+        log(LOG_END_COMMAND, 0, 0, nullptr, 0);
+        finished = pending.size();
+    }
+
+    // Writes every finished command to the log file and waits for the disk
+    void commit() {
+        if (finished == 0) return;
+        size_t done = 0;
+        while (done < finished) {
+            ssize_t n = pwrite(fd, pending.data() + done, finished - done, fileSize + done);
+            if (n < 0) {
+                cerr << "write-ahead log write failed" << endl;
+                abort();
+            }
+            done += n;
+        }
+        ioCounters.bytesWritten += finished;
+        fdatasync(fd);
+        fileSize += finished;
+        pending.erase(pending.begin(), pending.begin() + finished);
+        finished = 0;
+    }
+
+    // Calls apply(tag, index, offset, image, size) for every entry of every
+    // complete command in the log file, in order. Stops at a torn or corrupt
+    // tail.
+    template <typename Apply>
+    void replay(Apply apply) {
+        vector<char> data(fileSize);
+        size_t got = 0;
+        while (got < fileSize) {
+            ssize_t n = pread(fd, data.data() + got, fileSize - got, got);
+            if (n <= 0) break;
+            got += n;
+        }
+        ioCounters.bytesRead += got;
+
+        size_t offset = 0, commandStart = 0;
+        while (offset + sizeof(EntryHeader) <= got) {
+            EntryHeader header;
+            memcpy(&header, &data[offset], sizeof(EntryHeader));
+            size_t end = offset + sizeof(EntryHeader) + header.size;
+            if (header.size < 0 || end > got) break;
+            const char* image = &data[offset + sizeof(EntryHeader)];
+            if (checksum(header, image) != header.checksum) break;
+            offset = end;
+
+            if (header.tag != LOG_END_COMMAND) continue;
+            while (commandStart + sizeof(EntryHeader) < offset) {
+                memcpy(&header, &data[commandStart], sizeof(EntryHeader));
+                apply(header.tag, header.index, header.offset,
+                      &data[commandStart + sizeof(EntryHeader)], header.size);
+                commandStart += sizeof(EntryHeader) + header.size;
+            }
+            commandStart = offset;
+        }
+    }
+
+    // Empties the log file once the data files hold every committed change
+    void truncate() {
+        if (ftruncate(fd, 0) != 0) {
+            cerr << "write-ahead log truncate failed" << endl;
+            abort();
+        }
+        fsync(fd);
+        fileSize = 0;
+    }
+};
+
+// ==================== Paged Files ====================
+
+const int PAGE_SIZE = 4096;
+const size_t BUFFER_POOL_BYTES = 16 * 1024 * 1024;
+
+// With BOOKSTORE_MMAP the record and text files are also mapped read-only,
+// and reads of pages that are not cached in the buffer pool are served from
+// the mapping without a copy. Writes still go through the pool, so they
+// reach the files only after their log entries, as for any other file. Each
+// mapped file reserves MAP_RESERVE bytes of address space and grows in
+// MAP_CHUNK steps; at most about MAPPED_BYTES of mapped pages are kept
+// resident at a time.
+#ifdef BOOKSTORE_MMAP
+const bool MAP_DATA_FILES = true;
+#else
+const bool MAP_DATA_FILES = false;
+#endif
+const size_t MAP_RESERVE = 1ULL << 30;
+const size_t MAP_CHUNK = 1024 * 1024;
+const size_t MAPPED_BYTES = 16 * 1024 * 1024;
+
+class BufferPool;
+
+// A file accessed in PAGE_SIZE units through a shared BufferPool. The file
+// is created on first use. Pages past the end of the file read as zeros.
+class PageFile {
+private:
+    friend class BufferPool;
+
+    BufferPool& pool;
+    int poolId;
+    int fd;
+    bool created;
+    char* map;          // start of the reserved range, nullptr if not mapped
+    size_t mappedBytes; // file bytes currently mapped
+
+    void readRaw(int id, char* buf);
+    void writeRaw(int id, const char* buf);
+    // Extends the file and its mapping to cover at least bytes
+    void grow(size_t bytes);
+    // Lets the kernel drop the resident mapped pages; their contents stay
+    // in the file
+    void trim();
+
+public:
+    // A mapped file serves reads of uncached pages straight from its mapping
+    PageFile(const string& filename, BufferPool& pool, bool mapped = false);
+    ~PageFile();
+
+    PageFile(const PageFile&) = delete;
+    PageFile& operator=(const PageFile&) = delete;
+
+    // True if the file did not exist and was created empty
+    bool isNew() const {
+        return created;
+    }
+
+    // Returns the cached page, which stays valid until unpinned
+    char* pin(int id);
+    void unpin(int id, bool dirty);
+    // Like pin() for reading only; a mapped file returns an uncached page
+    // from its mapping
+    const char* pinRead(int id);
+    void unpinRead(int id);
+
+    void read(int id, void* buf, size_t size);
+    // Writes size bytes at the start of page id, zero-filling the rest
+    void write(int id, const void* buf, size_t size);
+    // Waits until the written pages are on disk
+    void sync();
+};
+
+// Page cache shared by every PageFile, holding at most a fixed number of
+// bytes. Pages are replaced with the CLOCK policy; pinned pages are never
+// evicted and dirty pages are written back on eviction or flush.
+//
+// The write-ahead log is committed before any dirty page is written back.
+// Pages dirtied by the command in progress are evicted only when more than
+// half of the pool holds such pages, so a crash normally cannot leave part
+// of a command on disk without its log entries.
+class BufferPool {
+private:
+    struct Frame {
+        PageFile* file;
+        int pageId;
+        int pinCount;
+        bool dirty;
+        bool referenced;
+        unsigned int dirtyCommand; // command that last dirtied the page
+    };
+
+    vector<char> memory;
+    vector<Frame> frames;
+    unordered_map<unsigned long long, int> pageTable;
+    vector<PageFile*> files;
+    WriteAheadLog* log;
+    int clockHand;
+    unsigned int command;
+    size_t commandFrames; // dirty frames last dirtied by the current command
+    size_t mappedPins;    // pins of mapped pages since the last trim
+
+    static unsigned long long keyOf(const PageFile& file, int pageId) {
+        return ((unsigned long long)file.poolId << 32) | (unsigned int)pageId;
+    }
+
+    char* dataOf(int frame) {
+        return &memory[(size_t)frame * PAGE_SIZE];
+    }
+
+    bool inCurrentCommand(const Frame& f) const {
+        return f.dirty && f.dirtyCommand == command;
+    }
+
+    void writeBack(int frame) {
+        Frame& f = frames[frame];
+        if (f.dirty) {
+            if (log) log->commit();
+            if (inCurrentCommand(f)) commandFrames--;
+            f.file->writeRaw(f.pageId, dataOf(frame));
+            f.dirty = false;
+        }
+    }
+
+    // Finds a frame that holds no pinned page, evicting its current page
+    int victim() {
+        bool keepCommand = commandFrames < frames.size() / 2;
+        for (size_t scanned = 0; scanned < 2 * frames.size() + 1; scanned++) {
+            int frame = clockHand;
+            clockHand = (clockHand + 1) % frames.size();
+            Frame& f = frames[frame];
+            if (f.file == nullptr) return frame;
+            if (f.pinCount > 0) continue;
+            if (keepCommand && inCurrentCommand(f)) continue;
+            if (f.referenced) {
+                f.referenced = false;
+                continue;
+            }
+            writeBack(frame);
+            pageTable.erase(keyOf(*f.file, f.pageId));
+            f.file = nullptr;
+            return frame;
+        }
+        cerr << "buffer pool exhausted: every page is pinned" << endl;
+        abort();
+    }
+
+public:
+    BufferPool(size_t bytes, WriteAheadLog* log)
+        : log(log), clockHand(0), command(0), commandFrames(0), mappedPins(0) {
+        size_t count = max<size_t>(bytes / PAGE_SIZE, 16);
+        memory.resize(count * PAGE_SIZE);
+        frames.assign(count, Frame{nullptr, -1, 0, false, false, 0});
+        pageTable.reserve(count);
+    }
+
+    int registerFile(PageFile& file) {
+        files.push_back(&file);
+        return files.size() - 1;
+    }
+
+    void unregisterFile(PageFile& file) {
+        flush(file, true);
+        files[file.poolId] = nullptr;
+    }
+
+    bool isCached(const PageFile& file, int pageId) const {
+        return pageTable.count(keyOf(file, pageId)) > 0;
+    }
+
+    // Counts a pin of a mapped page. Once the pins could have made more
+    // than MAPPED_BYTES resident, every mapped file is trimmed.
+    void pinMapped() {
+        if (++mappedPins < MAPPED_BYTES / PAGE_SIZE) return;
+        for (PageFile* file : files) {
+            if (file && file->map) file->trim();
+        }
+        mappedPins = 0;
+    }
+
+    // Marks the end of a command; its pages become ordinary eviction
+    // candidates
+    void endCommand() {
+        command++;
+        commandFrames = 0;
+    }
+
+    char* pin(PageFile& file, int pageId) {
+        auto it = pageTable.find(keyOf(file, pageId));
+        if (it != pageTable.end()) {
+            Frame& f = frames[it->second];
+            f.pinCount++;
+            f.referenced = true;
+            return dataOf(it->second);
+        }
+
+        int frame = victim();
+        file.readRaw(pageId, dataOf(frame));
+        frames[frame] = Frame{&file, pageId, 1, false, true, 0};
+        pageTable[keyOf(file, pageId)] = frame;
+        return dataOf(frame);
+    }
+
+    void unpin(PageFile& file, int pageId, bool dirty) {
+        Frame& f = frames[pageTable[keyOf(file, pageId)]];
+        f.pinCount--;
+        if (dirty && !inCurrentCommand(f)) {
+            f.dirty = true;
+            f.dirtyCommand = command;
+            commandFrames++;
+        }
+    }
+
+    // Writes back the dirty pages of file; with drop, also forgets them
+    void flush(PageFile& file, bool drop) {
+        for (size_t frame = 0; frame < frames.size(); frame++) {
+            Frame& f = frames[frame];
+            if (f.file != &file) continue;
+            writeBack(frame);
+            if (drop) {
+                pageTable.erase(keyOf(file, f.pageId));
+                f = Frame{nullptr, -1, 0, false, false, 0};
+            }
+        }
+    }
+
+    // True if some cached page holds changes not yet written back
+    bool hasDirtyPages() const {
+        for (const Frame& frame : frames) {
+            if (frame.file && frame.dirty) return true;
+        }
+        return false;
+    }
+
+    // Writes back every dirty page and waits until all files are on disk
+    void flushAll() {
+        for (size_t frame = 0; frame < frames.size(); frame++) {
+            if (frames[frame].file) writeBack(frame);
+        }
+        for (PageFile* file : files) {
+            if (file) file->sync();
+        }
+    }
+};
+
+PageFile::PageFile(const string& filename, BufferPool& pool, bool mapped)
+    : pool(pool), poolId(pool.registerFile(*this)), created(false), map(nullptr), mappedBytes(0) {
+    fd = open(filename.c_str(), O_RDWR);
+    if (fd < 0) {
+        created = true;
+        fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    }
+    if (fd < 0) {
+        cerr << "cannot open " << filename << endl;
+        abort();
+    }
+    ioCounters.fileOpens++;
+    if (mapped) {
+        // Reserving the whole range up front means growing never moves the
+        // mapping, so pinned pages stay valid
+        void* range = mmap(nullptr, MAP_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (range == MAP_FAILED) {
+            cerr << "cannot reserve address space for " << filename << endl;
+            abort();
+        }
+        map = (char*)range;
+        grow(lseek(fd, 0, SEEK_END));
+    }
+}
+
+PageFile::~PageFile() {
+    pool.unregisterFile(*this);
+    if (map) munmap(map, MAP_RESERVE);
+    close(fd);
+}
+
+void PageFile::grow(size_t bytes) {
+    size_t size = max((bytes + MAP_CHUNK - 1) / MAP_CHUNK * MAP_CHUNK, MAP_CHUNK);
+    if (size <= mappedBytes) return;
+    if (size > MAP_RESERVE) {
+        cerr << "mapped file exceeds " << MAP_RESERVE << " bytes" << endl;
+        abort();
+    }
+    if ((size_t)lseek(fd, 0, SEEK_END) < size && ftruncate(fd, size) != 0) {
+        cerr << "cannot grow mapped file" << endl;
+        abort();
+    }
+    void* added = mmap(map + mappedBytes, size - mappedBytes, PROT_READ, MAP_SHARED | MAP_FIXED, fd,
+                       mappedBytes);
+    if (added == MAP_FAILED) {
+        cerr << "cannot map file" << endl;
+        abort();
+    }
+    mappedBytes = size;
+}
+
+void PageFile::trim() {
+    madvise(map, mappedBytes, MADV_DONTNEED);
+}
+
+void PageFile::readRaw(int id, char* buf) {
+    memset(buf, 0, PAGE_SIZE); // a short read past the end leaves zeros
+    size_t got = 0;
+    while (got < (size_t)PAGE_SIZE) {
+        ssize_t n = pread(fd, buf + got, PAGE_SIZE - got, (off_t)id * PAGE_SIZE + got);
+        if (n <= 0) break;
+        got += n;
+    }
+    ioCounters.bytesRead += got;
+}
+
+void PageFile::writeRaw(int id, const char* buf) {
+    size_t done = 0;
+    while (done < (size_t)PAGE_SIZE) {
+        ssize_t n = pwrite(fd, buf + done, PAGE_SIZE - done, (off_t)id * PAGE_SIZE + done);
+        if (n < 0) {
+            cerr << "page write failed" << endl;
+            abort();
+        }
+        done += n;
+    }
+    ioCounters.bytesWritten += PAGE_SIZE;
+}
+
+char* PageFile::pin(int id) {
+    return pool.pin(*this, id);
+}
+
+void PageFile::unpin(int id, bool dirty) {
+    pool.unpin(*this, id, dirty);
+}
+
+// A dirty cached page is newer than the file, so the mapping is used only
+// for pages the pool does not hold. Nothing can load the page between
+// pinRead() and unpinRead(), so both make the same choice.
+const char* PageFile::pinRead(int id) {
+    if (!map || pool.isCached(*this, id)) return pool.pin(*this, id);
+    grow((size_t)(id + 1) * PAGE_SIZE);
+    pool.pinMapped();
+    return map + (size_t)id * PAGE_SIZE;
+}
+
+void PageFile::unpinRead(int id) {
+    if (!map || pool.isCached(*this, id)) pool.unpin(*this, id, false);
+}
+
+void PageFile::read(int id, void* buf, size_t size) {
+    memcpy(buf, pinRead(id), size);
+    unpinRead(id);
+}
+
+void PageFile::write(int id, const void* buf, size_t size) {
+    char* page = pin(id);
+    memcpy(page, buf, size);
+    memset(page + size, 0, PAGE_SIZE - size);
+    unpin(id, true);
+}
+
+void PageFile::sync() {
+    fsync(fd);
+}
+
+// Array of fixed-size records stored in a PageFile. Page 0 holds the record
+// count; records never straddle a page boundary. Every write is recorded in
+// the write-ahead log under the file's tag.
+template <typename T>
+class RecordFile {
+private:
+    static constexpr int PER_PAGE = PAGE_SIZE / sizeof(T);
+
+    PageFile file;
+    WriteAheadLog& log;
+    int tag;
+    int count;
+
+    void store(int index, size_t offset, const void* data, size_t size) {
+        char* page = file.pin(1 + index / PER_PAGE);
+        memcpy(page + (index % PER_PAGE) * sizeof(T) + offset, data, size);
+        file.unpin(1 + index / PER_PAGE, true);
+    }
+
+public:
+    RecordFile(const string& filename, BufferPool& pool, WriteAheadLog& log, int tag)
+        : file(filename, pool, MAP_DATA_FILES), log(log), tag(tag), count(0) {
+        if (!file.isNew()) {
+            file.read(0, &count, sizeof(int));
+        }
+    }
+
+    // True if the file did not exist and was created empty
+    bool isNew() const {
+        return file.isNew();
+    }
+
+    int size() const {
+        return count;
+    }
+
+    void read(int index, T& record) {
+        const char* page = file.pinRead(1 + index / PER_PAGE);
+        memcpy(&record, page + (index % PER_PAGE) * sizeof(T), sizeof(T));
+        file.unpinRead(1 + index / PER_PAGE);
+    }
+
+    void write(int index, const T& record) {
+        log.log(tag, index, 0, &record, sizeof(T));
+        store(index, 0, &record, sizeof(T));
+    }
+
+    // Reads the field at offset within record index, e.g.
+    // readField(i, offsetof(BookRecord, price), price)
+    template <typename F>
+    void readField(int index, size_t offset, F& value) {
+        const char* page = file.pinRead(1 + index / PER_PAGE);
+        memcpy(&value, page + (index % PER_PAGE) * sizeof(T) + offset, sizeof(F));
+        file.unpinRead(1 + index / PER_PAGE);
+    }
+
+    // Replaces the field at offset within record index with update(field)
+    // while its page stays pinned. Returns false, leaving the field as it
+    // was, if update returns false.
+    template <typename F, typename Update>
+    bool updateField(int index, size_t offset, Update update) {
+        char* page = file.pin(1 + index / PER_PAGE);
+        char* field = page + (index % PER_PAGE) * sizeof(T) + offset;
+        F value;
+        memcpy(&value, field, sizeof(F));
+        bool changed = update(value);
+        if (changed) {
+            log.log(tag, index, offset, &value, sizeof(F));
+            memcpy(field, &value, sizeof(F));
+        }
+        file.unpin(1 + index / PER_PAGE, changed);
+        return changed;
+    }
+
+    int append(const T& record) {
+        int index = count++;
+        write(index, record);
+        file.write(0, &count, sizeof(int));
+        return index;
+    }
+
+    // Applies a logged write during recovery, growing the file if needed
+    void redo(int index, int offset, const char* image, int size) {
+        if (index < 0 || offset < 0 || size < 0 || offset + size > (int)sizeof(T)) return;
+        store(index, offset, image, size);
+        if (index >= count) {
+            count = index + 1;
+            file.write(0, &count, sizeof(int));
+        }
+    }
+};
+
+// Byte-addressed file of variable-length blobs stored in a PageFile. Page 0
+// holds the number of bytes in use; blobs are appended after it and may
+// span pages. Every write is recorded in the write-ahead log under the
+// file's tag, addressed by page and offset within the page.
+class HeapFile {
+private:
+    PageFile file;
+    WriteAheadLog& log;
+    int tag;
+    long long end;
+
+    void loadEnd() {
+        file.read(0, &end, sizeof(end));
+        end = max(end, (long long)PAGE_SIZE);
+    }
+
+    void store(long long pos, const char* data, int size) {
+        while (size > 0) {
+            int page = pos / PAGE_SIZE;
+            int offset = pos % PAGE_SIZE;
+            int chunk = min(size, PAGE_SIZE - offset);
+            log.log(tag, page, offset, data, chunk);
+            memcpy(file.pin(page) + offset, data, chunk);
+            file.unpin(page, true);
+            pos += chunk;
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+public:
+    HeapFile(const string& filename, BufferPool& pool, WriteAheadLog& log, int tag)
+        : file(filename, pool, MAP_DATA_FILES), log(log), tag(tag), end(PAGE_SIZE) {
+        if (!file.isNew()) loadEnd();
+    }
+
+    void read(long long pos, char* data, int size) {
+        while (size > 0) {
+            int page = pos / PAGE_SIZE;
+            int offset = pos % PAGE_SIZE;
+            int chunk = min(size, PAGE_SIZE - offset);
+            memcpy(data, file.pinRead(page) + offset, chunk);
+            file.unpinRead(page);
+            pos += chunk;
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    // Overwrites bytes of a blob returned by append()
+    void write(long long pos, const char* data, int size) {
+        store(pos, data, size);
+    }
+
+    // Stores a new blob and returns its position
+    long long append(const char* data, int size) {
+        long long pos = end;
+        store(pos, data, size);
+        end += size;
+        store(0, (const char*)&end, sizeof(end));
+        return pos;
+    }
+
+    // Bytes in use, header page included
+    long long size() const {
+        return end;
+    }
+
+    // Applies a logged write during recovery
+    void redo(int page, int offset, const char* image, int size) {
+        if (page < 0 || offset < 0 || size < 0 || offset + size > PAGE_SIZE) return;
+        memcpy(file.pin(page) + offset, image, size);
+        file.unpin(page, true);
+        if (page == 0) loadEnd();
+    }
+};
+
+// ==================== Disk-based B+ Tree ====================
+
+// B+ tree stored in a single file of fixed-size pages. Page 0 is a header
+// holding the root page id and the page count; every other page is a node.
+// Keys are unique. Erase does not rebalance: underfull leaves are left in
+// place, which keeps every search path valid at the cost of some slack.
+template <typename Key, typename Value>
+class BPlusTree {
+private:
+    struct Header {
+        int root;
+        int pageCount;
+    };
+
+    static constexpr int MAX_KEYS =
+        (PAGE_SIZE - 3 * (int)sizeof(int) - (int)sizeof(int)) /
+        ((int)sizeof(Key) + (int)max(sizeof(Value), sizeof(int))) - 1;
+
+    struct Node {
+        int isLeaf;
+        int count;
+        int next; // right sibling of a leaf, -1 if none
+        Key keys[MAX_KEYS + 1];
+        union {
+            Value values[MAX_KEYS + 1];
+            int children[MAX_KEYS + 2];
+        };
+    };
+
+    static_assert(sizeof(Node) <= PAGE_SIZE, "B+ tree node must fit in a page");
+
+    PageFile file;
+    Header header;
+
+    void readNode(int id, Node& node) {
+        file.read(id, &node, sizeof(Node));
+    }
+
+    void writeNode(int id, const Node& node) {
+        file.write(id, &node, sizeof(Node));
+    }
+
+    void writeHeader() {
+        file.write(0, &header, sizeof(Header));
+    }
+
+    int allocateNode(const Node& node) {
+        int id = header.pageCount++;
+        writeNode(id, node);
+        writeHeader();
+        return id;
+    }
+
+    // Index of the child that may contain key
+    static int childIndex(const Node& node, const Key& key) {
+        return upper_bound(node.keys, node.keys + node.count, key) - node.keys;
+    }
+
+    // Inserts into the subtree rooted at id. Returns false if the key
+    // already exists. On a split, sets splitId to the new right sibling and
+    // splitKey to its separator.
+    bool insertInto(int id, const Key& key, const Value& value, int& splitId, Key& splitKey) {
+        Node node;
+        readNode(id, node);
+        splitId = -1;
+
+        if (node.isLeaf) {
+            int pos = lower_bound(node.keys, node.keys + node.count, key) - node.keys;
+            if (pos < node.count && node.keys[pos] == key) return false;
+            for (int i = node.count; i > pos; i--) {
+                node.keys[i] = node.keys[i - 1];
+                node.values[i] = node.values[i - 1];
+            }
+            node.keys[pos] = key;
+            node.values[pos] = value;
+            node.count++;
+
+            if (node.count > MAX_KEYS) {
+                Node right;
+                right.isLeaf = 1;
+                int half = node.count / 2;
+                right.count = node.count - half;
+                for (int i = 0; i < right.count; i++) {
+                    right.keys[i] = node.keys[half + i];
+                    right.values[i] = node.values[half + i];
+                }
+                right.next = node.next;
+                node.count = half;
+                splitId = allocateNode(right);
+                splitKey = right.keys[0];
+                node.next = splitId;
+            }
+            writeNode(id, node);
+            return true;
+        }
+
+        int pos = childIndex(node, key);
+        int childSplitId;
+        Key childSplitKey;
+        if (!insertInto(node.children[pos], key, value, childSplitId, childSplitKey)) return false;
+        if (childSplitId == -1) return true;
+
+        for (int i = node.count; i > pos; i--) {
+            node.keys[i] = node.keys[i - 1];
+            node.children[i + 1] = node.children[i];
+        }
+        node.keys[pos] = childSplitKey;
+        node.children[pos + 1] = childSplitId;
+        node.count++;
+
+        if (node.count > MAX_KEYS) {
+            Node right;
+            right.isLeaf = 0;
+            right.next = -1;
+            int mid = node.count / 2;
+            right.count = node.count - mid - 1;
+            for (int i = 0; i < right.count; i++) {
+                right.keys[i] = node.keys[mid + 1 + i];
+                right.children[i] = node.children[mid + 1 + i];
+            }
+            right.children[right.count] = node.children[node.count];
+            splitKey = node.keys[mid];
+            node.count = mid;
+            splitId = allocateNode(right);
+        }
+        writeNode(id, node);
+        return true;
+    }
+
+    // Finds the leaf that may contain key
+    int findLeaf(const Key& key, Node& node) {
+        int id = header.root;
+        readNode(id, node);
+        while (!node.isLeaf) {
+            id = node.children[childIndex(node, key)];
+            readNode(id, node);
+        }
+        return id;
+    }
+
+public:
+    BPlusTree(const string& filename, BufferPool& pool) : file(filename, pool) {
+        if (file.isNew()) {
+            clear();
+        } else {
+            file.read(0, &header, sizeof(Header));
+        }
+    }
+
+    // True if the index file did not exist and was created empty
+    bool isNew() const {
+        return file.isNew();
+    }
+
+    int rootPage() const {
+        return header.root;
+    }
+
+    int pageCount() const {
+        return header.pageCount;
+    }
+
+    // Drops every entry, leaving a tree with a single empty leaf
+    void clear() {
+        header.root = 1;
+        header.pageCount = 2;
+        writeHeader();
+        Node root;
+        root.isLeaf = 1;
+        root.count = 0;
+        root.next = -1;
+        writeNode(1, root);
+    }
+
+    // Forward cursor over the leaf chain, in key order
+    class Iterator {
+    private:
+        friend class BPlusTree;
+
+        BPlusTree* tree;
+        Node node;
+        int pos;
+
+        // Moves past exhausted leaves
+        void settle() {
+            while (pos >= node.count && node.next != -1) {
+                tree->readNode(node.next, node);
+                pos = 0;
+            }
+        }
+
+    public:
+        bool valid() const {
+            return pos < node.count;
+        }
+
+        const Key& key() const {
+            return node.keys[pos];
+        }
+
+        const Value& value() const {
+            return node.values[pos];
+        }
+
+        void next() {
+            pos++;
+            settle();
+        }
+    };
+
+    // Cursor at the first entry not less than key
+    Iterator lowerBound(const Key& key) {
+        Iterator it;
+        it.tree = this;
+        findLeaf(key, it.node);
+        it.pos = lower_bound(it.node.keys, it.node.keys + it.node.count, key) - it.node.keys;
+        it.settle();
+        return it;
+    }
+
+    bool find(const Key& key, Value& value) {
+        Node node;
+        findLeaf(key, node);
+        int pos = lower_bound(node.keys, node.keys + node.count, key) - node.keys;
+        if (pos < node.count && node.keys[pos] == key) {
+            value = node.values[pos];
+            return true;
+        }
+        return false;
+    }
+
+    bool insert(const Key& key, const Value& value) {
+        int splitId;
+        Key splitKey;
+        if (!insertInto(header.root, key, value, splitId, splitKey)) return false;
+        if (splitId != -1) {
+            Node root;
+            root.isLeaf = 0;
+            root.count = 1;
+            root.next = -1;
+            root.keys[0] = splitKey;
+            root.children[0] = header.root;
+            root.children[1] = splitId;
+            header.root = allocateNode(root);
+            writeHeader();
+        }
+        return true;
+    }
+
+    // Replaces the value stored under key. Returns false if key is absent.
+    bool update(const Key& key, const Value& value) {
+        Node node;
+        int id = findLeaf(key, node);
+        int pos = lower_bound(node.keys, node.keys + node.count, key) - node.keys;
+        if (pos >= node.count || !(node.keys[pos] == key)) return false;
+        node.values[pos] = value;
+        writeNode(id, node);
+        return true;
+    }
+
+    bool erase(const Key& key) {
+        Node node;
+        int id = findLeaf(key, node);
+        int pos = lower_bound(node.keys, node.keys + node.count, key) - node.keys;
+        if (pos >= node.count || !(node.keys[pos] == key)) return false;
+        for (int i = pos; i + 1 < node.count; i++) {
+            node.keys[i] = node.keys[i + 1];
+            node.values[i] = node.values[i + 1];
+        }
+        node.count--;
+        writeNode(id, node);
+        return true;
+    }
+};
+
+// ==================== Disk-based Extendible Hash ====================
+
+// Extendible hash table stored in a single file of fixed-size pages.
+// Page 0 is a header, pages 1..DIR_PAGES hold the bucket directory and the
+// rest are bucket pages. The directory is kept in memory and written back
+// when it changes. Buckets at MAX_DEPTH no longer split and grow overflow
+// pages instead. Keys are unique and must provide hash().
+template <typename Key, typename Value>
+class ExtendibleHash {
+private:
+    static constexpr int MAX_DEPTH = 14;
+    static constexpr int DIR_ENTRIES_PER_PAGE = PAGE_SIZE / sizeof(int);
+    static constexpr int DIR_PAGES =
+        ((1 << MAX_DEPTH) + DIR_ENTRIES_PER_PAGE - 1) / DIR_ENTRIES_PER_PAGE;
+
+    struct Header {
+        int globalDepth;
+        int pageCount;
+    };
+
+    static constexpr int CAPACITY =
+        (PAGE_SIZE - 3 * (int)sizeof(int)) / ((int)sizeof(Key) + (int)sizeof(Value));
+
+    struct Bucket {
+        int localDepth;
+        int count;
+        int overflow; // next page of the same bucket, -1 if none
+        Key keys[CAPACITY];
+        Value values[CAPACITY];
+    };
+
+    static_assert(sizeof(Bucket) <= PAGE_SIZE, "hash bucket must fit in a page");
+
+    PageFile file;
+    Header header;
+    vector<int> directory;
+
+    void readBucket(int id, Bucket& bucket) {
+        file.read(id, &bucket, sizeof(Bucket));
+    }
+
+    void writeBucket(int id, const Bucket& bucket) {
+        file.write(id, &bucket, sizeof(Bucket));
+    }
+
+    void writeHeader() {
+        file.write(0, &header, sizeof(Header));
+    }
+
+    // Writes back the directory pages covering entries [from, to)
+    void writeDirectory(int from, int to) {
+        int first = from / DIR_ENTRIES_PER_PAGE;
+        int last = (to - 1) / DIR_ENTRIES_PER_PAGE;
+        for (int page = first; page <= last; page++) {
+            int begin = page * DIR_ENTRIES_PER_PAGE;
+            int count = min(DIR_ENTRIES_PER_PAGE, (int)directory.size() - begin);
+            file.write(1 + page, &directory[begin], count * sizeof(int));
+        }
+    }
+
+    int allocateBucket(const Bucket& bucket) {
+        int id = header.pageCount++;
+        writeBucket(id, bucket);
+        writeHeader();
+        return id;
+    }
+
+    int slotOf(const Key& key) const {
+        return key.hash() & ((1u << header.globalDepth) - 1);
+    }
+
+    // Splits the single-page bucket at page id, doubling the directory if
+    // needed
+    void split(int id, Bucket& bucket) {
+        if (bucket.localDepth == header.globalDepth) {
+            int size = directory.size();
+            directory.resize(size * 2);
+            for (int i = 0; i < size; i++) {
+                directory[size + i] = directory[i];
+            }
+            header.globalDepth++;
+            writeDirectory(size, size * 2);
+            writeHeader();
+        }
+
+        unsigned int bit = 1u << bucket.localDepth;
+        Bucket sibling;
+        sibling.localDepth = bucket.localDepth + 1;
+        sibling.count = 0;
+        sibling.overflow = -1;
+        bucket.localDepth++;
+
+        int kept = 0;
+        for (int i = 0; i < bucket.count; i++) {
+            if (bucket.keys[i].hash() & bit) {
+                sibling.keys[sibling.count] = bucket.keys[i];
+                sibling.values[sibling.count] = bucket.values[i];
+                sibling.count++;
+            } else {
+                bucket.keys[kept] = bucket.keys[i];
+                bucket.values[kept] = bucket.values[i];
+                kept++;
+            }
+        }
+        bucket.count = kept;
+
+        int siblingId = allocateBucket(sibling);
+        writeBucket(id, bucket);
+        for (int i = 0; i < (int)directory.size(); i++) {
+            if (directory[i] == id && (i & bit)) {
+                directory[i] = siblingId;
+                writeDirectory(i, i + 1);
+            }
+        }
+    }
+
+public:
+    ExtendibleHash(const string& filename, BufferPool& pool) : file(filename, pool) {
+        if (file.isNew()) {
+            clear();
+        } else {
+            file.read(0, &header, sizeof(Header));
+            directory.resize(1 << header.globalDepth);
+            for (int page = 0; page * DIR_ENTRIES_PER_PAGE < (int)directory.size(); page++) {
+                int begin = page * DIR_ENTRIES_PER_PAGE;
+                int count = min(DIR_ENTRIES_PER_PAGE, (int)directory.size() - begin);
+                file.read(1 + page, &directory[begin], count * sizeof(int));
+            }
+        }
+    }
+
+    // True if the index file did not exist and was created empty
+    bool isNew() const {
+        return file.isNew();
+    }
+
+    int globalDepth() const {
+        return header.globalDepth;
+    }
+
+    int pageCount() const {
+        return header.pageCount;
+    }
+
+    // Drops every entry, leaving a single empty bucket
+    void clear() {
+        header.globalDepth = 0;
+        header.pageCount = 1 + DIR_PAGES;
+        Bucket bucket;
+        bucket.localDepth = 0;
+        bucket.count = 0;
+        bucket.overflow = -1;
+        directory.assign(1, allocateBucket(bucket));
+        writeDirectory(0, 1);
+    }
+
+    bool find(const Key& key, Value& value) {
+        Bucket bucket;
+        for (int id = directory[slotOf(key)]; id != -1; id = bucket.overflow) {
+            readBucket(id, bucket);
+            for (int i = 0; i < bucket.count; i++) {
+                if (bucket.keys[i] == key) {
+                    value = bucket.values[i];
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool insert(const Key& key, const Value& value) {
+        Value existing;
+        if (find(key, existing)) return false;
+
+        while (true) {
+            int id = directory[slotOf(key)];
+            Bucket bucket;
+            readBucket(id, bucket);
+
+            if (bucket.count == CAPACITY && bucket.localDepth < MAX_DEPTH) {
+                split(id, bucket);
+                continue;
+            }
+
+            // Walk the overflow chain to the first page with room
+            while (bucket.count == CAPACITY && bucket.overflow != -1) {
+                id = bucket.overflow;
+                readBucket(id, bucket);
+            }
+            if (bucket.count == CAPACITY) {
+                Bucket extra;
+                extra.localDepth = bucket.localDepth;
+                extra.count = 0;
+                extra.overflow = -1;
+                bucket.overflow = allocateBucket(extra);
+                writeBucket(id, bucket);
+                id = bucket.overflow;
+                bucket = extra;
+            }
+
+            bucket.keys[bucket.count] = key;
+            bucket.values[bucket.count] = value;
+            bucket.count++;
+            writeBucket(id, bucket);
+            return true;
+        }
+    }
+
+    bool erase(const Key& key) {
+        Bucket bucket;
+        for (int id = directory[slotOf(key)]; id != -1; id = bucket.overflow) {
+            readBucket(id, bucket);
+            for (int i = 0; i < bucket.count; i++) {
+                if (bucket.keys[i] == key) {
+                    bucket.count--;
+                    bucket.keys[i] = bucket.keys[bucket.count];
+                    bucket.values[i] = bucket.values[bucket.count];
+                    writeBucket(id, bucket);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+// ==================== Bloom Filter ====================
+
+// Persisted blocked Bloom filter over string keys. Each key sets hashCount
+// bits inside one 512-bit block, so a lookup touches a single cache line.
+// Page 0 is a header and the bit array follows; the bits are kept in
+// memory and written back a page at a time when they change.
+//
+// The filter is sized from an expected number of keys and a target
+// false-positive rate. A file created with another sizing is discarded and
+// reported by needsRebuild(), as is a new file; the owner then re-adds its
+// keys. Keys cannot be removed: a deleted key only costs a false positive.
+class BloomFilter {
+private:
+    static constexpr int BLOCK_BITS = 512;
+    static constexpr int WORDS_PER_BLOCK = BLOCK_BITS / 64;
+    static constexpr int WORDS_PER_PAGE = PAGE_SIZE / sizeof(unsigned long long);
+
+    struct Header {
+        int blockCount;
+        int hashCount;
+    };
+
+    PageFile file;
+    Header header;
+    vector<unsigned long long> words;
+    bool stale;
+
+    static unsigned long long mix(unsigned long long x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static unsigned long long hashOf(string_view key) {
+        unsigned long long h = 14695981039346656037ULL;
+        for (char c : key) h = (h ^ (unsigned char)c) * 1099511628211ULL;
+        return mix(h);
+    }
+
+    // First word of the block that key maps to
+    size_t blockOf(unsigned long long h) const {
+        return (size_t)((h >> 32) % header.blockCount) * WORDS_PER_BLOCK;
+    }
+
+    void writePage(int page) {
+        file.write(1 + page, &words[(size_t)page * WORDS_PER_PAGE], PAGE_SIZE);
+    }
+
+    void reset() {
+        fill(words.begin(), words.end(), 0);
+        file.write(0, &header, sizeof(Header));
+        for (int page = 0; page * WORDS_PER_PAGE < (int)words.size(); page++) writePage(page);
+    }
+
+public:
+    BloomFilter(const string& filename, BufferPool& pool, int capacity, double falsePositiveRate)
+        : file(filename, pool) {
+        double bits = ceil(-capacity * log(falsePositiveRate) / (log(2.0) * log(2.0)));
+        Header wanted;
+        wanted.blockCount = max(1, (int)ceil(bits / BLOCK_BITS));
+        wanted.hashCount = min(16, max(1, (int)lround(bits / capacity * log(2.0))));
+
+        int pages = (wanted.blockCount * WORDS_PER_BLOCK + WORDS_PER_PAGE - 1) / WORDS_PER_PAGE;
+        words.assign((size_t)pages * WORDS_PER_PAGE, 0);
+        if (!file.isNew()) file.read(0, &header, sizeof(Header));
+        stale = file.isNew() || header.blockCount != wanted.blockCount ||
+                header.hashCount != wanted.hashCount;
+        header = wanted;
+        if (stale) {
+            reset();
+        } else {
+            for (int page = 0; page < pages; page++) {
+                file.read(1 + page, &words[(size_t)page * WORDS_PER_PAGE], PAGE_SIZE);
+            }
+        }
+    }
+
+    // True if the filter was created empty and does not reflect the keys
+    // stored so far
+    bool needsRebuild() const {
+        return stale;
+    }
+
+    // Empties the filter; the owner re-adds its keys
+    void clear() {
+        reset();
+        stale = false;
+    }
+
+    void add(string_view key) {
+        unsigned long long h = hashOf(key);
+        size_t block = blockOf(h);
+        bool changed = false;
+        for (int i = 0; i < header.hashCount; i++) {
+            h = mix(h);
+            unsigned long long& word = words[block + (h & (BLOCK_BITS - 1)) / 64];
+            unsigned long long bit = 1ULL << (h & 63);
+            changed |= !(word & bit);
+            word |= bit;
+        }
+        if (changed) writePage((int)(block / WORDS_PER_PAGE));
+    }
+
+    // False only if key was never added
+    bool mightContain(string_view key) const {
+        unsigned long long h = hashOf(key);
+        size_t block = blockOf(h);
+        for (int i = 0; i < header.hashCount; i++) {
+            h = mix(h);
+            if (!(words[block + (h & (BLOCK_BITS - 1)) / 64] & (1ULL << (h & 63)))) return false;
+        }
+        return true;
+    }
+};
+
+// ==================== Superblock ====================
+
+// Version of the on-disk format. A store written by an older version is
+// brought up to date by rebuilding its indexes; a newer one is refused.
+const int FORMAT_VERSION = 1;
+
+// Root page and page count of a B+ tree index
+struct IndexShape {
+    int root;
+    int pageCount;
+
+    bool operator!=(const IndexShape& other) const {
+        return root != other.root || pageCount != other.pageCount;
+    }
+};
+
+// Record counts and index shapes of the store at a checkpoint. On startup
+// they are compared with the file headers to spot files that no longer
+// belong together. Transactions and finance aggregates have no derived
+// state, so they are not recorded.
+struct StoreLayout {
+    long long bookTextBytes;
+    int accountCount;
+    int accountIndexDepth; // global depth and page count of accounts.idx
+    int accountIndexPages;
+    int bookCount;
+    IndexShape isbnIndex;
+    IndexShape nameIndex;
+    IndexShape authorIndex;
+    IndexShape keywordIndex;
+    int operationCount;
+    IndexShape operatorIndex;
+    IndexShape staffIndex;
+};
+
+// Store-wide metadata in a file of its own: the format version, the layout
+// at the last checkpoint and whether the store was shut down cleanly. It is
+// written directly rather than through the buffer pool, so it can be
+// brought to disk between flushing the data files and emptying the log.
+// Nothing in the store reuses freed space yet, so there are no free lists
+// to record.
+class Superblock {
+private:
+    static constexpr char MAGIC[8] = {'B', 'O', 'O', 'K', 'S', 'T', 'O', 'R'};
+
+    struct Image {
+        char magic[8];
+        int version;
+        int clean;
+        StoreLayout layout;
+        unsigned int checksum;
+    };
+
+    int fd;
+    Image image;
+    bool valid;
+
+    // FNV-1a over everything before the checksum, to spot a torn write
+    static unsigned int checksum(const Image& image) {
+        return fnv1a(&image, offsetof(Image, checksum));
+    }
+
+public:
+    Superblock(const string& filename) : valid(false) {
+        fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            cerr << "cannot open " << filename << endl;
+            abort();
+        }
+        ioCounters.fileOpens++;
+        memset(&image, 0, sizeof(Image));
+        ssize_t got = pread(fd, &image, sizeof(Image), 0);
+        if (got > 0) ioCounters.bytesRead += got;
+        if (got != (ssize_t)sizeof(Image) || memcmp(image.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            checksum(image) != image.checksum) {
+            return;
+        }
+        if (image.version > FORMAT_VERSION) {
+            cerr << filename << " has format version " << image.version << ", newer than "
+                 << FORMAT_VERSION << endl;
+            abort();
+        }
+        valid = image.version == FORMAT_VERSION;
+    }
+
+    ~Superblock() {
+        close(fd);
+    }
+
+    Superblock(const Superblock&) = delete;
+    Superblock& operator=(const Superblock&) = delete;
+
+    // False for a new store, one from an older version and a torn write
+    bool isValid() const {
+        return valid;
+    }
+
+    // True if the store was shut down cleanly after the last checkpoint
+    bool wasClean() const {
+        return image.clean != 0;
+    }
+
+    const StoreLayout& layout() const {
+        return image.layout;
+    }
+
+    // Replaces the superblock and waits for the disk
+    void write(const StoreLayout& layout, bool clean) {
+        memset(&image, 0, sizeof(Image));
+        memcpy(image.magic, MAGIC, sizeof(MAGIC));
+        image.version = FORMAT_VERSION;
+        image.clean = clean;
+        image.layout = layout;
+        image.checksum = checksum(image);
+        if (pwrite(fd, &image, sizeof(Image), 0) != (ssize_t)sizeof(Image)) {
+            cerr << "superblock write failed" << endl;
+            abort();
+        }
+        ioCounters.bytesWritten += sizeof(Image);
+        fdatasync(fd);
+        valid = true;
+    }
+};
+
+// ==================== File-based Storage ====================
+
+// Expected number of accounts, and the false-positive rate the userID
+// filter is sized for; changing either rebuilds accounts.bloom on start
+const int ACCOUNT_FILTER_CAPACITY = 1 << 17;
+const double ACCOUNT_FILTER_FP_RATE = 0.01;
+
+// Likewise for the ISBN filter in books.bloom
+const int BOOK_FILTER_CAPACITY = 1 << 18;
+const double BOOK_FILTER_FP_RATE = 0.01;
+
+class AccountManager {
+private:
+    RecordFile<Account> accounts;
+    ExtendibleHash<FixedString<31>, int> userIndex;
+    BloomFilter userFilter; // answers most lookups of unknown userIDs
+
+public:
+    AccountManager(BufferPool& pool, WriteAheadLog& log)
+        : accounts("accounts.dat", pool, log, LOG_ACCOUNTS),
+          userIndex("accounts.idx", pool),
+          userFilter("accounts.bloom", pool, ACCOUNT_FILTER_CAPACITY, ACCOUNT_FILTER_FP_RATE) {
+        if (accounts.isNew()) {
+            // Initialize root account
+            Account root;
+            strcpy(root.userID, "root");
+            strcpy(root.password, "sjtu");
+            root.privilege = 7;
+            strcpy(root.username, "root");
+            addAccount(root);
+        } else if (userIndex.isNew() || userFilter.needsRebuild()) {
+            rebuildIndex();
+        }
+    }
+
+    // Recreates the userID index and filter from the account records.
+    // Deleted records are zeroed and have an empty userID.
+    void rebuildIndex() {
+        userIndex.clear();
+        userFilter.clear();
+        Account acc;
+        for (int i = 0; i < accounts.size(); i++) {
+            accounts.read(i, acc);
+            if (acc.userID[0]) {
+                userIndex.insert(FixedString<31>(acc.userID), i);
+                userFilter.add(acc.userID);
+            }
+        }
+    }
+
+    // Replays a logged account write; call rebuildIndex() afterwards
+    void redo(int index, int offset, const char* image, int size) {
+        accounts.redo(index, offset, image, size);
+    }
+
+    // Fills in the account part of layout
+    void describe(StoreLayout& layout) const {
+        layout.accountCount = accounts.size();
+        layout.accountIndexDepth = userIndex.globalDepth();
+        layout.accountIndexPages = userIndex.pageCount();
+    }
+
+    void addAccount(const Account& acc) {
+        int index = accounts.append(acc);
+        userIndex.insert(FixedString<31>(acc.userID), index);
+        userFilter.add(acc.userID);
+    }
+
+    bool findAccount(string_view userID, Account& acc) {
+        if (!userFilter.mightContain(userID)) return false;
+        int index;
+        if (!userIndex.find(FixedString<31>(userID), index)) return false;
+        accounts.read(index, acc);
+        return true;
+    }
+
+    bool deleteAccount(string_view userID) {
+        int index;
+        if (!userIndex.find(FixedString<31>(userID), index)) return false;
+        accounts.write(index, Account());
+        userIndex.erase(FixedString<31>(userID));
+        return true;
+    }
+
+    bool updatePassword(string_view userID, string_view newPassword) {
+        int index;
+        if (!userIndex.find(FixedString<31>(userID), index)) return false;
+        Account acc;
+        accounts.read(index, acc);
+        copyField(acc.password, newPassword);
+        accounts.write(index, acc);
+        return true;
+    }
+};
+
+// Secondary index key: a text field (name, author or one keyword segment)
+// followed by the ISBN, so equal fields are ordered by ISBN
+using BookFieldKey = PairKey<FixedString<61>, FixedString<21>>;
+
+class BookManager {
+private:
+    static constexpr int MAX_TEXT = sizeof(Book::name) + sizeof(Book::author) + sizeof(Book::keyword);
+
+    RecordFile<BookRecord> books;
+    HeapFile bookText;
+    BPlusTree<FixedString<21>, int> isbnIndex;
+    BPlusTree<BookFieldKey, int> nameIndex;
+    BPlusTree<BookFieldKey, int> authorIndex;
+    BPlusTree<BookFieldKey, int> keywordIndex;
+    BloomFilter isbnFilter; // answers most lookups of ISBNs not in use
+
+    static void reindexField(BPlusTree<BookFieldKey, int>& index, const Book& old, const char* oldValue,
+                             const Book& book, const char* value, int record) {
+        if (strcmp(old.ISBN, book.ISBN) == 0 && strcmp(oldValue, value) == 0) return;
+        if (oldValue[0]) index.erase(BookFieldKey(oldValue, old.ISBN));
+        if (value[0]) index.insert(BookFieldKey(value, book.ISBN), record);
+    }
+
+    // Moves the secondary index entries of record from old to book. Pass a
+    // default Book as old for a record that is not indexed yet.
+    void reindex(const Book& old, const Book& book, int record) {
+        reindexField(nameIndex, old, old.name, book, book.name, record);
+        reindexField(authorIndex, old, old.author, book, book.author, record);
+        if (strcmp(old.ISBN, book.ISBN) == 0 && strcmp(old.keyword, book.keyword) == 0) return;
+        if (old.keyword[0]) {
+            for (const string& kw : split(old.keyword, '|')) {
+                keywordIndex.erase(BookFieldKey(kw, old.ISBN));
+            }
+        }
+        if (book.keyword[0]) {
+            for (const string& kw : split(book.keyword, '|')) {
+                keywordIndex.insert(BookFieldKey(kw, book.ISBN), record);
+            }
+        }
+    }
+
+    // Assembles the full book from its record and text
+    void load(const BookRecord& record, Book& book) {
+        book = Book();
+        memcpy(book.ISBN, record.ISBN, sizeof(book.ISBN));
+        book.price = record.price;
+        book.quantity = record.quantity;
+        if (record.textLength == 0) return;
+
+        char text[MAX_TEXT];
+        bookText.read(record.textOffset, text, record.textLength);
+        const char* field = text;
+        copyField(book.name, field);
+        field += strlen(field) + 1;
+        copyField(book.author, field);
+        field += strlen(field) + 1;
+        copyField(book.keyword, field);
+    }
+
+    void load(int handle, Book& book) {
+        BookRecord record;
+        books.read(handle, record);
+        load(record, book);
+    }
+
+    // Writes the text fields of book for record, in place if they fit in
+    // the space already reserved
+    void storeText(BookRecord& record, const Book& book) {
+        char text[MAX_TEXT];
+        int length = 0;
+        for (const char* field : {book.name, book.author, book.keyword}) {
+            int size = strlen(field) + 1;
+            memcpy(text + length, field, size);
+            length += size;
+        }
+        if (length == 3) length = 0;
+
+        if (length > record.textCapacity) {
+            record.textOffset = bookText.append(text, length);
+            record.textCapacity = length;
+        } else if (length > 0) {
+            bookText.write(record.textOffset, text, length);
+        }
+        record.textLength = length;
+    }
+
+    static bool sameText(const Book& a, const Book& b) {
+        return strcmp(a.name, b.name) == 0 && strcmp(a.author, b.author) == 0 &&
+               strcmp(a.keyword, b.keyword) == 0;
+    }
+
+    // Calls visit(book) for each book whose entry in index has the given
+    // field value, one book at a time
+    template <typename Visit>
+    void scanField(BPlusTree<BookFieldKey, int>& index, string_view value, Visit visit) {
+        FixedString<61> field(value);
+        Book book;
+        for (auto it = index.lowerBound(BookFieldKey(field, FixedString<21>()));
+             it.valid() && it.key().first == field; it.next()) {
+            load(it.value(), book);
+            visit(book);
+        }
+    }
+
+    // Recreates the chosen indexes from the book records. The text heap is
+    // read only for the secondary indexes.
+    void rebuildIndexes(bool rebuildISBN, bool rebuildFields) {
+        if (rebuildISBN) {
+            isbnIndex.clear();
+            isbnFilter.clear();
+        }
+        if (rebuildFields) {
+            nameIndex.clear();
+            authorIndex.clear();
+            keywordIndex.clear();
+        }
+        if (rebuildISBN || rebuildFields) {
+            BookRecord record;
+            Book book;
+            for (int i = 0; i < books.size(); i++) {
+                books.read(i, record);
+                if (rebuildISBN) {
+                    isbnIndex.insert(FixedString<21>(record.ISBN), i);
+                    isbnFilter.add(record.ISBN);
+                }
+                if (rebuildFields) {
+                    load(record, book);
+                    reindex(Book(), book, i);
+                }
+            }
+        }
+    }
+
+public:
+    BookManager(BufferPool& pool, WriteAheadLog& log)
+        : books("books.dat", pool, log, LOG_BOOKS),
+          bookText("booktext.dat", pool, log, LOG_BOOK_TEXT),
+          isbnIndex("books.idx", pool),
+          nameIndex("names.idx", pool),
+          authorIndex("authors.idx", pool),
+          keywordIndex("keywords.idx", pool),
+          isbnFilter("books.bloom", pool, BOOK_FILTER_CAPACITY, BOOK_FILTER_FP_RATE) {
+        // Rebuild missing indexes
+        rebuildIndexes(isbnIndex.isNew() || isbnFilter.needsRebuild(),
+                       nameIndex.isNew() || authorIndex.isNew() || keywordIndex.isNew());
+    }
+
+    void rebuildIndexes() {
+        rebuildIndexes(true, true);
+    }
+
+    // Fills in the book part of layout
+    void describe(StoreLayout& layout) const {
+        layout.bookCount = books.size();
+        layout.bookTextBytes = bookText.size();
+        layout.isbnIndex = {isbnIndex.rootPage(), isbnIndex.pageCount()};
+        layout.nameIndex = {nameIndex.rootPage(), nameIndex.pageCount()};
+        layout.authorIndex = {authorIndex.rootPage(), authorIndex.pageCount()};
+        layout.keywordIndex = {keywordIndex.rootPage(), keywordIndex.pageCount()};
+    }
+
+    // Replays a logged write to books.dat (LOG_BOOKS) or the text heap;
+    // call rebuildIndexes() afterwards
+    void redo(int tag, int index, int offset, const char* image, int size) {
+        if (tag == LOG_BOOKS) {
+            books.redo(index, offset, image, size);
+        } else {
+            bookText.redo(index, offset, image, size);
+        }
+    }
+
+    // Stores a book whose ISBN is not in use yet and returns its handle
+    int addBook(const Book& book) {
+        BookRecord record;
+        memcpy(record.ISBN, book.ISBN, sizeof(record.ISBN));
+        record.price = book.price;
+        record.quantity = book.quantity;
+        storeText(record, book);
+        int handle = books.append(record);
+        isbnIndex.insert(FixedString<21>(book.ISBN), handle);
+        isbnFilter.add(book.ISBN);
+        reindex(Book(), book, handle);
+        return handle;
+    }
+
+    // Rewrites the book behind handle. A changed ISBN renames the book: the
+    // record keeps its handle and only the index entries move, so the new
+    // ISBN must not be in use.
+    void updateBook(int handle, const Book& book) {
+        BookRecord record;
+        Book old;
+        books.read(handle, record);
+        load(record, old);
+        memcpy(record.ISBN, book.ISBN, sizeof(record.ISBN));
+        record.price = book.price;
+        record.quantity = book.quantity;
+        if (!sameText(old, book)) storeText(record, book);
+        books.write(handle, record);
+        if (strcmp(old.ISBN, book.ISBN) != 0) {
+            isbnIndex.erase(FixedString<21>(old.ISBN));
+            isbnIndex.insert(FixedString<21>(book.ISBN), handle);
+            isbnFilter.add(book.ISBN);
+        }
+        reindex(old, book, handle);
+    }
+
+    bool findBook(string_view ISBN, Book& book) {
+        if (!isbnFilter.mightContain(ISBN)) return false;
+        int index;
+        if (!isbnIndex.find(FixedString<21>(ISBN), index)) return false;
+        load(index, book);
+        return true;
+    }
+
+    // Handle of the record holding ISBN, or -1. Records are never moved or
+    // removed, so a handle stays valid for the life of the file.
+    int locate(string_view ISBN) {
+        if (!isbnFilter.mightContain(ISBN)) return -1;
+        int index;
+        if (!isbnIndex.find(FixedString<21>(ISBN), index)) return -1;
+        return index;
+    }
+
+    void read(int handle, Book& book) {
+        load(handle, book);
+    }
+
+    FixedString<21> getISBN(int handle) {
+        FixedString<21> isbn;
+        books.readField(handle, offsetof(BookRecord, ISBN), isbn.data);
+        return isbn;
+    }
+
+    Money getPrice(int handle) {
+        Money price;
+        books.readField(handle, offsetof(BookRecord, price), price);
+        return price;
+    }
+
+    // Adds delta to the stock of the book. Returns false, changing nothing,
+    // if the stock would become negative.
+    bool addQuantity(int handle, long long delta) {
+        return books.updateField<long long>(handle, offsetof(BookRecord, quantity), [delta](long long& quantity) {
+            if (quantity + delta < 0) return false;
+            quantity += delta;
+            return true;
+        });
+    }
+
+    // Forward cursor yielding books in ISBN order, one record at a time
+    class Cursor {
+    private:
+        friend class BookManager;
+
+        BookManager* manager;
+        BPlusTree<FixedString<21>, int>::Iterator it;
+        Book current;
+
+        void load() {
+            if (it.valid()) manager->load(it.value(), current);
+        }
+
+    public:
+        bool valid() const {
+            return it.valid();
+        }
+
+        const Book& book() const {
+            return current;
+        }
+
+        void next() {
+            it.next();
+            load();
+        }
+    };
+
+    // Calls visit(ISBN, handle) for every book, in ISBN order, without
+    // loading the books
+    template <typename Visit>
+    void forEachBook(Visit visit) {
+        for (auto it = isbnIndex.lowerBound(FixedString<21>()); it.valid(); it.next()) {
+            visit(it.key(), it.value());
+        }
+    }
+
+    Cursor scanAll() {
+        Cursor cursor;
+        cursor.manager = this;
+        cursor.it = isbnIndex.lowerBound(FixedString<21>());
+        cursor.load();
+        return cursor;
+    }
+
+    // The searches below call visit(book) for every match, in ISBN order,
+    // without collecting the matches first
+
+    template <typename Visit>
+    void searchByISBN(string_view ISBN, Visit visit) {
+        Book book;
+        if (findBook(ISBN, book)) visit(book);
+    }
+
+    template <typename Visit>
+    void searchByName(string_view name, Visit visit) {
+        scanField(nameIndex, name, visit);
+    }
+
+    template <typename Visit>
+    void searchByAuthor(string_view author, Visit visit) {
+        scanField(authorIndex, author, visit);
+    }
+
+    template <typename Visit>
+    void searchByKeyword(string_view keyword, Visit visit) {
+        scanField(keywordIndex, keyword, visit);
+    }
+};
+
+// Transactions in order, plus running finance aggregates. finance.dat
+// holds the store-wide totals in record 0 and the totals of the book with
+// handle h in record h + 1, updated on every sale and import.
+class TransactionManager {
+private:
+    RecordFile<Transaction> transactions;
+    RecordFile<FinanceRecord> finance;
+
+    // Adds the sale or import to the aggregate in record index
+    void accumulate(int index, Money amount, int type, long long quantity) {
+        FinanceRecord record;
+        finance.read(index, record);
+        if (type == 1) {
+            record.unitsSold += quantity;
+            record.revenue += amount;
+        } else {
+            record.unitsImported += quantity;
+            record.importCost += amount;
+        }
+        finance.write(index, record);
+    }
+
+    // Totals over the first count transactions
+    void prefixTotals(int count, Money& income, Money& expenditure) {
+        income = expenditure = Money();
+        if (count == 0) return;
+        Transaction trans;
+        transactions.read(count - 1, trans);
+        income = trans.totalIncome;
+        expenditure = trans.totalExpenditure;
+    }
+
+public:
+    TransactionManager(BufferPool& pool, WriteAheadLog& log)
+        : transactions("transactions.dat", pool, log, LOG_TRANSACTIONS),
+          finance("finance.dat", pool, log, LOG_FINANCE) {
+        if (finance.size() == 0) {
+            // Data from before the aggregates existed only has store totals
+            FinanceRecord totals;
+            prefixTotals(transactions.size(), totals.revenue, totals.importCost);
+            finance.append(totals);
+        }
+    }
+
+    // Replays a logged transaction or aggregate write
+    void redo(int tag, int index, int offset, const char* image, int size) {
+        if (tag == LOG_TRANSACTIONS) {
+            transactions.redo(index, offset, image, size);
+        } else {
+            finance.redo(index, offset, image, size);
+        }
+    }
+
+    // Records a sale (type 1) or import (type -1) of quantity copies of the
+    // book with the given handle
+    void addTransaction(Money amount, int type, int handle, long long quantity) {
+        Transaction trans;
+        trans.amount = amount;
+        trans.type = type;
+        prefixTotals(transactions.size(), trans.totalIncome, trans.totalExpenditure);
+        if (type == 1) {
+            trans.totalIncome += amount;
+        } else {
+            trans.totalExpenditure += amount;
+        }
+        transactions.append(trans);
+
+        while (finance.size() <= handle + 1) finance.append(FinanceRecord());
+        accumulate(0, amount, type, quantity);
+        accumulate(handle + 1, amount, type, quantity);
+    }
+
+    int size() const {
+        return transactions.size();
+    }
+
+    // Totals over the last count transactions, count <= size()
+    void getTotals(int count, Money& income, Money& expenditure) {
+        Money beforeIncome, beforeExpenditure;
+        prefixTotals(transactions.size(), income, expenditure);
+        prefixTotals(transactions.size() - count, beforeIncome, beforeExpenditure);
+        income = income - beforeIncome;
+        expenditure = expenditure - beforeExpenditure;
+    }
+
+    FinanceRecord getTotals() {
+        FinanceRecord totals;
+        finance.read(0, totals);
+        return totals;
+    }
 
-struct Transaction {
-    double amount;
-    int type; // 1: income, -1: expenditure
+    // Aggregate of one book; zero if it was never sold or imported
+    FinanceRecord getBookTotals(int handle) {
+        FinanceRecord record;
+        if (handle + 1 < finance.size()) finance.read(handle + 1, record);
+        return record;
+    }
 };
 
-// ==================== File-based Storage ====================
-
-class AccountManager {
+// Append-only operation log. Entries are fixed-width records in log order;
+// an index from each operator to their newest entry lets one operator's
+// work be read by following the chain, without scanning the whole log. A
+// second index holds only the staff, operators whose newest entry was made
+// with privilege 3 or more, so the employee report does not grow with the
+// number of customers.
+class LogManager {
 private:
-    const string filename = "accounts.dat";
+    RecordFile<OpRecord> operations;
+    BPlusTree<FixedString<31>, OperatorEntry> latestByUser;
+    BPlusTree<FixedString<31>, int> latestByStaff;
 
 public:
-    AccountManager() {
-        // Initialize root account if needed
-        ifstream test(filename);
-        if (!test.good()) {
-            Account root;
-            strcpy(root.userID, "root");
-            strcpy(root.password, "sjtu");
-            root.privilege = 7;
-            strcpy(root.username, "root");
-            addAccount(root);
+    LogManager(BufferPool& pool, WriteAheadLog& log)
+        : operations("operations.dat", pool, log, LOG_OPERATIONS),
+          latestByUser("operators.idx", pool),
+          latestByStaff("staff.idx", pool) {
+        if (latestByUser.isNew() || latestByStaff.isNew()) rebuildIndex();
+    }
+
+    // Recreates the operator and staff indexes from the log
+    void rebuildIndex() {
+        latestByUser.clear();
+        latestByStaff.clear();
+        OpRecord op;
+        for (int i = 0; i < operations.size(); i++) {
+            operations.read(i, op);
+            FixedString<31> user(op.userID);
+            OperatorEntry entry{i, op.privilege};
+            if (!latestByUser.update(user, entry)) latestByUser.insert(user, entry);
+        }
+        for (auto it = latestByUser.lowerBound(FixedString<31>()); it.valid(); it.next()) {
+            if (it.value().privilege >= 3) latestByStaff.insert(it.key(), it.value().latest);
         }
     }
 
-    void addAccount(const Account& acc) {
-        ofstream file(filename, ios::binary | ios::app);
-        file.write(reinterpret_cast<const char*>(&acc), sizeof(Account));
-        file.close();
+    // Replays a logged operation write; call rebuildIndex() afterwards
+    void redo(int index, int offset, const char* image, int size) {
+        operations.redo(index, offset, image, size);
     }
 
-    bool findAccount(const string& userID, Account& acc) {
-        ifstream file(filename, ios::binary);
-        if (!file.is_open()) return false;
+    // Fills in the operation log part of layout
+    void describe(StoreLayout& layout) const {
+        layout.operationCount = operations.size();
+        layout.operatorIndex = {latestByUser.rootPage(), latestByUser.pageCount()};
+        layout.staffIndex = {latestByStaff.rootPage(), latestByStaff.pageCount()};
+    }
 
-        while (file.read(reinterpret_cast<char*>(&acc), sizeof(Account))) {
-            if (string(acc.userID) == userID) {
-                file.close();
-                return true;
-            }
+    // Appends op, filling in its sequence number and chain link
+    void addLog(OpRecord op) {
+        FixedString<31> user(op.userID);
+        OperatorEntry entry;
+        bool known = latestByUser.find(user, entry);
+        op.previousByUser = known ? entry.latest : -1;
+        op.sequence = operations.size() + 1;
+        int index = operations.append(op);
+        if (known) {
+            latestByUser.update(user, OperatorEntry{index, op.privilege});
+        } else {
+            latestByUser.insert(user, OperatorEntry{index, op.privilege});
+        }
+        if (op.privilege >= 3) {
+            if (!latestByStaff.update(user, index)) latestByStaff.insert(user, index);
+        } else if (known && entry.privilege >= 3) {
+            latestByStaff.erase(user);
         }
-        file.close();
-        return false;
     }
 
-    bool deleteAccount(const string& userID) {
-        vector<Account> accounts;
-        ifstream inFile(filename, ios::binary);
-        Account acc;
-        bool found = false;
-
-        while (inFile.read(reinterpret_cast<char*>(&acc), sizeof(Account))) {
-            if (string(acc.userID) != userID) {
-                accounts.push_back(acc);
-            } else {
-                found = true;
-            }
-        }
-        inFile.close();
+    int size() const {
+        return operations.size();
+    }
 
-        if (!found) return false;
+    void read(int index, OpRecord& op) {
+        operations.read(index, op);
+    }
 
-        ofstream outFile(filename, ios::binary | ios::trunc);
-        for (const auto& a : accounts) {
-            outFile.write(reinterpret_cast<const char*>(&a), sizeof(Account));
+    // Calls visit(userID, index of newest entry) for every staff operator,
+    // in userID order
+    template <typename Visit>
+    void forEachStaff(Visit visit) {
+        for (auto it = latestByStaff.lowerBound(FixedString<31>()); it.valid(); it.next()) {
+            visit(it.key(), it.value());
         }
-        outFile.close();
-        return true;
     }
+};
 
-    bool updatePassword(const string& userID, const string& newPassword) {
-        vector<Account> accounts;
-        ifstream inFile(filename, ios::binary);
-        Account acc;
-        bool found = false;
+// ==================== Input ====================
 
-        while (inFile.read(reinterpret_cast<char*>(&acc), sizeof(Account))) {
-            if (string(acc.userID) == userID) {
-                strcpy(acc.password, newPassword.c_str());
-                found = true;
+// Reads a file descriptor in large blocks and hands out one line at a time
+// as a view into the block, so no line is copied. A line cut by a block
+// boundary is moved to the front of the buffer before the next read; a
+// line longer than the buffer grows it. Lines end at '\n', '\r' or "\r\n",
+// and the last line need not be terminated.
+class InputReader {
+private:
+    static constexpr size_t BLOCK = 1 << 20;
+
+    int fd;
+    vector<char> buffer;
+    size_t begin, end; // unread bytes are buffer[begin, end)
+    bool eof;
+    bool skipNewline;  // the last line ended with '\r'; drop a following '\n'
+
+    void fill() {
+        if (begin > 0) {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == buffer.size()) buffer.resize(buffer.size() * 2);
+        while (true) {
+            ssize_t got = read(fd, buffer.data() + end, buffer.size() - end);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) {
+                eof = true;
+            } else {
+                end += got;
             }
-            accounts.push_back(acc);
+            return;
         }
-        inFile.close();
+    }
+
+public:
+    explicit InputReader(int fd = STDIN_FILENO)
+        : fd(fd), buffer(BLOCK), begin(0), end(0), eof(false), skipNewline(false) {}
+
+    // Sets line to the next line, without its terminator. The view stays
+    // valid until the next call. Returns false at end of input.
+    bool next(string_view& line) {
+        while (true) {
+            if (skipNewline && begin < end) {
+                if (buffer[begin] == '\n') begin++;
+                skipNewline = false;
+            }
 
-        if (!found) return false;
+            const char* start = buffer.data() + begin;
+            size_t available = end - begin;
+            const char* stop = (const char*)memchr(start, '\n', available);
+            const char* cr = (const char*)memchr(start, '\r', stop ? stop - start : available);
+            if (cr) stop = cr;
+            if (stop) {
+                line = string_view(start, stop - start);
+                begin += stop - start + 1;
+                skipNewline = cr != nullptr;
+                return true;
+            }
 
-        ofstream outFile(filename, ios::binary | ios::trunc);
-        for (const auto& a : accounts) {
-            outFile.write(reinterpret_cast<const char*>(&a), sizeof(Account));
+            if (eof) {
+                if (available == 0) return false;
+                line = string_view(start, available);
+                begin = end;
+                return true;
+            }
+            fill();
         }
-        outFile.close();
-        return true;
     }
 };
 
-class BookManager {
+// ==================== Output ====================
+
+// Buffered writer for stdout. Data reaches the file descriptor only when the
+// buffer fills, on flush(), or on destruction, instead of once per line.
+//
+// Given the write-ahead log, a full buffer commits it before writing, so no
+// response leaves the process before its command is durable. The response
+// of the command in progress is held back then, unless it fills the buffer
+// on its own; only read-only commands print that much.
+class OutputBuffer {
 private:
-    const string filename = "books.dat";
+    static constexpr size_t CAPACITY = 1 << 20;
+
+    vector<char> buffer;
+    size_t used;
+    size_t finished; // leading bytes of buffer that belong to whole commands
+    WriteAheadLog* log;
+
+    // Makes room in a full buffer
+    void drain() {
+        if (log) log->commit();
+        size_t size = finished > 0 ? finished : used;
+        fwrite(buffer.data(), 1, size, stdout);
+        fflush(stdout);
+        memmove(buffer.data(), buffer.data() + size, used - size);
+        used -= size;
+        finished = 0;
+    }
 
 public:
-    void addOrUpdateBook(const Book& book) {
-        vector<Book> books;
-        ifstream inFile(filename, ios::binary);
-        Book b;
-        bool found = false;
-
-        while (inFile.read(reinterpret_cast<char*>(&b), sizeof(Book))) {
-            if (string(b.ISBN) == string(book.ISBN)) {
-                books.push_back(book);
-                found = true;
-            } else {
-                books.push_back(b);
-            }
-        }
-        inFile.close();
+    OutputBuffer(WriteAheadLog* log = nullptr) : buffer(CAPACITY), used(0), finished(0), log(log) {}
 
-        if (!found) {
-            books.push_back(book);
-        }
+    ~OutputBuffer() {
+        flush();
+    }
 
-        ofstream outFile(filename, ios::binary | ios::trunc);
-        for (const auto& bk : books) {
-            outFile.write(reinterpret_cast<const char*>(&bk), sizeof(Book));
+    void write(const char* data, size_t size) {
+        while (size > 0) {
+            if (used == CAPACITY) drain();
+            size_t chunk = min(size, CAPACITY - used);
+            memcpy(&buffer[used], data, chunk);
+            used += chunk;
+            data += chunk;
+            size -= chunk;
         }
-        outFile.close();
     }
 
-    bool findBook(const string& ISBN, Book& book) {
-        ifstream file(filename, ios::binary);
-        if (!file.is_open()) return false;
+    // Closes the response of the current command
+    void endCommand() {
+        finished = used;
+    }
 
-        while (file.read(reinterpret_cast<char*>(&book), sizeof(Book))) {
-            if (string(book.ISBN) == ISBN) {
-                file.close();
-                return true;
-            }
-        }
-        file.close();
-        return false;
+    // Writes out everything; the caller commits the log first
+    void flush() {
+        if (used == 0) return;
+        fwrite(buffer.data(), 1, used, stdout);
+        fflush(stdout);
+        used = finished = 0;
     }
 
-    vector<Book> getAllBooks() {
-        vector<Book> books;
-        ifstream file(filename, ios::binary);
-        if (!file.is_open()) return books;
+    OutputBuffer& operator<<(const char* str) {
+        write(str, strlen(str));
+        return *this;
+    }
 
-        Book book;
-        while (file.read(reinterpret_cast<char*>(&book), sizeof(Book))) {
-            books.push_back(book);
-        }
-        file.close();
-        return books;
+    OutputBuffer& operator<<(string_view str) {
+        write(str.data(), str.length());
+        return *this;
     }
 
-    vector<Book> searchByISBN(const string& ISBN) {
-        vector<Book> result;
-        vector<Book> all = getAllBooks();
-        for (const auto& book : all) {
-            if (string(book.ISBN) == ISBN) {
-                result.push_back(book);
-            }
-        }
-        return result;
+    OutputBuffer& operator<<(char c) {
+        if (used == CAPACITY) drain();
+        buffer[used++] = c;
+        return *this;
     }
 
-    vector<Book> searchByName(const string& name) {
-        vector<Book> result;
-        vector<Book> all = getAllBooks();
-        for (const auto& book : all) {
-            if (string(book.name) == name) {
-                result.push_back(book);
-            }
-        }
-        return result;
+    OutputBuffer& operator<<(int value) {
+        return *this << (long long)value;
     }
 
-    vector<Book> searchByAuthor(const string& author) {
-        vector<Book> result;
-        vector<Book> all = getAllBooks();
-        for (const auto& book : all) {
-            if (string(book.author) == author) {
-                result.push_back(book);
-            }
-        }
-        return result;
+    OutputBuffer& operator<<(long long value) {
+        char text[24];
+        write(text, snprintf(text, sizeof(text), "%lld", value));
+        return *this;
     }
 
-    vector<Book> searchByKeyword(const string& keyword) {
-        vector<Book> result;
-        vector<Book> all = getAllBooks();
-        for (const auto& book : all) {
-            string keywords = string(book.keyword);
-            vector<string> parts = split(keywords, '|');
-            for (const string& kw : parts) {
-                if (kw == keyword) {
-                    result.push_back(book);
-                    break;
-                }
-            }
-        }
-        return result;
+    // Amounts are always printed with two decimal places
+    OutputBuffer& operator<<(Money value) {
+        char text[32];
+        long long cents = llabs(value.cents);
+        write(text, snprintf(text, sizeof(text), "%s%lld.%02lld", value.cents < 0 ? "-" : "",
+                             cents / 100, cents % 100));
+        return *this;
     }
 };
 
-class TransactionManager {
-private:
-    const string filename = "transactions.dat";
+// ==================== Command Parsing ====================
 
-public:
-    void addTransaction(double amount, int type) {
-        Transaction trans;
-        trans.amount = amount;
-        trans.type = type;
+// Tokens of one command line, as views into the caller's buffer
+struct Tokens {
+    // More than any valid command has; extra tokens are only counted
+    static constexpr size_t MAX_TOKENS = 8;
 
-        ofstream file(filename, ios::binary | ios::app);
-        file.write(reinterpret_cast<const char*>(&trans), sizeof(Transaction));
-        file.close();
+    string_view items[MAX_TOKENS];
+    size_t count;
+
+    size_t size() const {
+        return count;
     }
 
-    vector<Transaction> getTransactions() {
-        vector<Transaction> result;
-        ifstream file(filename, ios::binary);
-        if (!file.is_open()) return result;
+    string_view operator[](size_t i) const {
+        return items[i];
+    }
+};
 
-        Transaction trans;
-        while (file.read(reinterpret_cast<char*>(&trans), sizeof(Transaction))) {
-            result.push_back(trans);
+// Splits a command on spaces without copying. A token may contain a quoted
+// string with spaces in it; a token that starts with a quote is the text up
+// to the closing quote.
+void tokenize(string_view cmd, Tokens& tokens) {
+    tokens.count = 0;
+    size_t pos = 0;
+    while (pos < cmd.length()) {
+        while (pos < cmd.length() && cmd[pos] == ' ') pos++;
+        if (pos >= cmd.length()) break;
+
+        string_view token;
+        if (cmd[pos] == '"') {
+            size_t start = ++pos;
+            while (pos < cmd.length() && cmd[pos] != '"') pos++;
+            token = cmd.substr(start, pos - start);
+            if (pos < cmd.length()) pos++; // Skip closing quote
+        } else {
+            size_t start = pos;
+            bool inQuote = false;
+            while (pos < cmd.length() && (inQuote || cmd[pos] != ' ')) {
+                if (cmd[pos] == '"') inQuote = !inQuote;
+                pos++;
+            }
+            token = cmd.substr(start, pos - start);
         }
-        file.close();
-        return result;
+        if (token.empty()) continue;
+        if (tokens.count < Tokens::MAX_TOKENS) tokens.items[tokens.count] = token;
+        tokens.count++;
     }
+}
+
+enum Command {
+    CMD_UNKNOWN, CMD_QUIT, CMD_EXIT, CMD_SU, CMD_LOGOUT, CMD_REGISTER, CMD_PASSWD,
+    CMD_USERADD, CMD_DELETE, CMD_SHOW, CMD_BUY, CMD_SELECT, CMD_MODIFY, CMD_IMPORT,
+    CMD_LOG, CMD_REPORT, CMD_STATS
 };
 
-class LogManager {
-private:
-    const string filename = "logs.txt";
+const int COMMAND_COUNT = CMD_STATS + 1;
 
-public:
-    void addLog(const string& log) {
-        ofstream file(filename, ios::app);
-        file << log << endl;
-        file.close();
+struct CommandEntry {
+    string_view keyword;
+    Command command;
+};
+
+constexpr CommandEntry COMMANDS[] = {
+    {"quit", CMD_QUIT}, {"exit", CMD_EXIT}, {"su", CMD_SU}, {"logout", CMD_LOGOUT},
+    {"register", CMD_REGISTER}, {"passwd", CMD_PASSWD}, {"useradd", CMD_USERADD},
+    {"delete", CMD_DELETE}, {"show", CMD_SHOW}, {"buy", CMD_BUY}, {"select", CMD_SELECT},
+    {"modify", CMD_MODIFY}, {"import", CMD_IMPORT}, {"log", CMD_LOG}, {"report", CMD_REPORT},
+    {"stats", CMD_STATS},
+};
+
+constexpr size_t COMMAND_TABLE_SIZE = 25;
+
+// Perfect hash over the command keywords, checked below at compile time
+constexpr size_t commandHash(string_view word) {
+    return (word.length() + (unsigned char)word[0] * 9 + (unsigned char)word.back() * 10) %
+           COMMAND_TABLE_SIZE;
+}
+
+struct CommandTable {
+    CommandEntry slots[COMMAND_TABLE_SIZE];
+};
+
+constexpr CommandTable buildCommandTable() {
+    CommandTable table = {};
+    for (const CommandEntry& entry : COMMANDS) {
+        table.slots[commandHash(entry.keyword)] = entry;
     }
+    return table;
+}
 
-    vector<string> getLogs() {
-        vector<string> result;
-        ifstream file(filename);
-        if (!file.is_open()) return result;
+constexpr CommandTable COMMAND_TABLE = buildCommandTable();
 
-        string line;
-        while (getline(file, line)) {
-            result.push_back(line);
-        }
-        file.close();
-        return result;
+constexpr bool commandHashIsPerfect() {
+    for (const CommandEntry& entry : COMMANDS) {
+        if (COMMAND_TABLE.slots[commandHash(entry.keyword)].command != entry.command) return false;
+    }
+    return true;
+}
+
+static_assert(commandHashIsPerfect(), "command keywords collide in commandHash");
+
+Command lookupCommand(string_view word) {
+    const CommandEntry& entry = COMMAND_TABLE.slots[commandHash(word)];
+    return entry.keyword == word ? entry.command : CMD_UNKNOWN;
+}
+
+string_view commandName(Command command) {
+    for (const CommandEntry& entry : COMMANDS) {
+        if (entry.command == command) return entry.keyword;
     }
+    return "?";
+}
+
+enum ParamKind {
+    PARAM_INVALID = 0,
+    PARAM_ISBN = 1,
+    PARAM_NAME = 2,
+    PARAM_AUTHOR = 4,
+    PARAM_KEYWORD = 8,
+    PARAM_PRICE = 16
 };
 
+// Classifies a -ISBN=, -name="", -author="", -keyword="" or -price=
+// parameter and sets value to its content without the quotes
+ParamKind classifyParam(string_view param, string_view& value) {
+    struct Prefix {
+        string_view text;
+        ParamKind kind;
+        bool quoted;
+    };
+    static constexpr Prefix PREFIXES[] = {
+        {"-ISBN=", PARAM_ISBN, false},
+        {"-name=\"", PARAM_NAME, true},
+        {"-author=\"", PARAM_AUTHOR, true},
+        {"-keyword=\"", PARAM_KEYWORD, true},
+        {"-price=", PARAM_PRICE, false},
+    };
+    for (const Prefix& prefix : PREFIXES) {
+        if (param.substr(0, prefix.text.length()) != prefix.text) continue;
+        value = param.substr(prefix.text.length());
+        if (prefix.quoted) {
+            if (param.back() != '"') return PARAM_INVALID;
+            value = value.substr(0, value.empty() ? 0 : value.length() - 1);
+        }
+        return prefix.kind;
+    }
+    return PARAM_INVALID;
+}
+
 // ==================== Session Management ====================
 
 struct Session {
-    string userID;
+    FixedString<31> userID;
     int privilege;
-    string selectedISBN;
+    int selectedBook = -1; // book record handle, -1 if no book is selected
 };
 
+// Commands gathered into one log commit, and the log size that triggers a
+// checkpoint
+const int GROUP_COMMIT_COMMANDS = 256;
+const size_t CHECKPOINT_BYTES = 4 * 1024 * 1024;
+
 class BookstoreSystem {
 private:
+    Superblock superblock;
+    WriteAheadLog wal;     // must outlive the buffer pool
+    BufferPool bufferPool; // must outlive the managers below
     AccountManager accountMgr;
     BookManager bookMgr;
     TransactionManager transMgr;
     LogManager logMgr;
     vector<Session> loginStack;
+    OutputBuffer out;      // commits the log before writing to stdout
+    int uncommitted; // finished commands not yet committed to the log
+    CommandStats stats;
 
     int getCurrentPrivilege() {
         if (loginStack.empty()) return 0;
         return loginStack.back().privilege;
     }
 
-    string& getCurrentSelectedISBN() {
-        static string empty;
-        empty = "";  // Reset to ensure it's always empty
+    void printBook(const Book& book) {
+        out << book.ISBN << '\t' << book.name << '\t' << book.author << '\t'
+            << book.keyword << '\t' << book.price << '\t' << book.quantity << '\n';
+    }
+
+    // Records a successful command in the operation log, on behalf of the
+    // current session
+    void logOperation(Command command, string_view isbn = string_view(), long long quantity = 0,
+                      Money amount = Money(), string_view target = string_view(), int grantedPrivilege = 0) {
+        OpRecord op;
+        if (!loginStack.empty()) {
+            copyField(op.userID, string_view(loginStack.back().userID.data));
+            op.privilege = loginStack.back().privilege;
+        }
+        op.opcode = command;
+        copyField(op.target, target);
+        copyField(op.ISBN, isbn);
+        op.quantity = quantity;
+        op.amount = amount;
+        op.grantedPrivilege = grantedPrivilege;
+        logMgr.addLog(op);
+    }
+
+    int& getCurrentSelectedBook() {
+        static int empty;
+        empty = -1;  // Reset to ensure it's always empty
         if (loginStack.empty()) return empty;
-        return loginStack.back().selectedISBN;
+        return loginStack.back().selectedBook;
     }
 
 public:
-    void processCommand(const string& line) {
-        string cmd = trim(line);
-        if (cmd.empty()) return;
-
-        // Parse tokens, keeping quoted strings together
-        vector<string> tokens;
-        size_t pos = 0;
-        while (pos < cmd.length()) {
-            // Skip whitespace
-            while (pos < cmd.length() && cmd[pos] == ' ') pos++;
-            if (pos >= cmd.length()) break;
-
-            // Find token
-            string token;
-            if (cmd[pos] == '"') {
-                // This shouldn't happen - quotes should be within a parameter
-                // But handle it anyway
-                pos++;
-                while (pos < cmd.length() && cmd[pos] != '"') {
-                    token += cmd[pos++];
-                }
-                if (pos < cmd.length()) pos++; // Skip closing quote
-            } else {
-                // Regular token - read until space
-                size_t start = pos;
-                // Check if this token contains a quoted string
-                bool inQuote = false;
-                while (pos < cmd.length() && (inQuote || cmd[pos] != ' ')) {
-                    if (cmd[pos] == '"') inQuote = !inQuote;
-                    pos++;
-                }
-                token = cmd.substr(start, pos - start);
+    BookstoreSystem()
+        : superblock("superblock.dat"),
+          wal("wal.log"),
+          bufferPool(BUFFER_POOL_BYTES, &wal),
+          accountMgr(bufferPool, wal),
+          bookMgr(bufferPool, wal),
+          transMgr(bufferPool, wal),
+          logMgr(bufferPool, wal),
+          out(&wal),
+          uncommitted(0) {
+        recover();
+        wal.endCommand();
+        bufferPool.endCommand();
+    }
+
+    ~BookstoreSystem() {
+        checkpoint(true);
+        if (stats.isEnabled()) cerr << stats.summary();
+    }
+
+    // Commits the finished commands, then sends buffered responses to stdout
+    void flushOutput() {
+        commit();
+        out.flush();
+    }
+
+    // Executes one command line. Returns false once the session should end.
+    bool processCommand(string_view line) {
+        CommandStats::Start start = stats.begin();
+        bool running = execute(line);
+        wal.endCommand();
+        bufferPool.endCommand();
+        out.endCommand();
+        if (++uncommitted >= GROUP_COMMIT_COMMANDS) commit();
+        if (stats.isEnabled()) stats.end(statsKeyword(line), start);
+        return running;
+    }
+
+private:
+    // Makes the finished commands durable, checkpointing once the log is large
+    void commit() {
+        wal.commit();
+        uncommitted = 0;
+        if (wal.size() >= CHECKPOINT_BYTES) checkpoint();
+    }
+
+    // Writes every change into the data files, records the new layout in
+    // the superblock and empties the log. Only the final checkpoint marks
+    // the store clean.
+    void checkpoint(bool clean = false) {
+        wal.commit();
+        bufferPool.flushAll();
+        superblock.write(layout(), clean);
+        wal.truncate();
+    }
+
+    StoreLayout layout() const {
+        StoreLayout layout = {};
+        accountMgr.describe(layout);
+        bookMgr.describe(layout);
+        logMgr.describe(layout);
+        return layout;
+    }
+
+    // Brings the store to a consistent state and marks it in use. After a
+    // clean shutdown this reads only the superblock and the file headers.
+    // After a crash the log is replayed and only the indexes over files it
+    // touched are rebuilt: the pool writes no page before the log entries
+    // of its changes, so the other indexes are as of the last checkpoint.
+    // Everything is rebuilt for a store without a valid superblock.
+    void recover() {
+        bool accounts = false, books = false, operations = false;
+        if (!superblock.isValid()) {
+            accounts = books = operations = true;
+        } else if (superblock.wasClean()) {
+            // A file replaced since the shutdown no longer matches the layout
+            const StoreLayout& saved = superblock.layout();
+            StoreLayout now = layout();
+            accounts = now.accountCount != saved.accountCount ||
+                       now.accountIndexDepth != saved.accountIndexDepth ||
+                       now.accountIndexPages != saved.accountIndexPages;
+            books = now.bookCount != saved.bookCount || now.bookTextBytes != saved.bookTextBytes ||
+                    now.isbnIndex != saved.isbnIndex || now.nameIndex != saved.nameIndex ||
+                    now.authorIndex != saved.authorIndex || now.keywordIndex != saved.keywordIndex;
+            operations = now.operationCount != saved.operationCount ||
+                         now.operatorIndex != saved.operatorIndex || now.staffIndex != saved.staffIndex;
+        }
+
+        wal.replay([&](int tag, int index, int offset, const char* image, int size) {
+            if (tag == LOG_ACCOUNTS) {
+                accountMgr.redo(index, offset, image, size);
+                accounts = true;
+            }
+            if (tag == LOG_BOOKS || tag == LOG_BOOK_TEXT) {
+                bookMgr.redo(tag, index, offset, image, size);
+                books = true;
             }
-            if (!token.empty()) tokens.push_back(token);
-        }
-
-        if (tokens.empty()) return;
-
-        if (tokens[0] == "quit" || tokens[0] == "exit") {
-            exit(0);
-        } else if (tokens[0] == "su") {
-            cmdSu(tokens);
-        } else if (tokens[0] == "logout") {
-            cmdLogout(tokens);
-        } else if (tokens[0] == "register") {
-            cmdRegister(tokens);
-        } else if (tokens[0] == "passwd") {
-            cmdPasswd(tokens);
-        } else if (tokens[0] == "useradd") {
-            cmdUseradd(tokens);
-        } else if (tokens[0] == "delete") {
-            cmdDelete(tokens);
-        } else if (tokens[0] == "show") {
-            cmdShow(tokens);
-        } else if (tokens[0] == "buy") {
-            cmdBuy(tokens);
-        } else if (tokens[0] == "select") {
-            cmdSelect(tokens);
-        } else if (tokens[0] == "modify") {
-            cmdModify(tokens);
-        } else if (tokens[0] == "import") {
-            cmdImport(tokens);
-        } else if (tokens[0] == "log") {
-            cmdLog(tokens);
-        } else if (tokens[0] == "report") {
-            cmdReport(tokens);
+            if (tag == LOG_TRANSACTIONS || tag == LOG_FINANCE) transMgr.redo(tag, index, offset, image, size);
+            if (tag == LOG_OPERATIONS) {
+                logMgr.redo(index, offset, image, size);
+                operations = true;
+            }
+        });
+        if (accounts) accountMgr.rebuildIndex();
+        if (books) bookMgr.rebuildIndexes();
+        if (operations) logMgr.rebuildIndex();
+
+        // Rebuilt indexes are not logged, so they reach the disk before the
+        // store is marked in use
+        if (wal.size() > 0 || bufferPool.hasDirtyPages()) {
+            checkpoint();
         } else {
-            cout << "Invalid" << endl;
+            superblock.write(layout(), false);
+        }
+    }
+
+    // Keyword a command line is charged to in the statistics
+    static string_view statsKeyword(string_view line) {
+        line = trim(line);
+        string_view keyword = line.substr(0, line.find(' '));
+        if (keyword.empty()) return "(empty)";
+        return lookupCommand(keyword) == CMD_UNKNOWN ? "(unknown)" : keyword;
+    }
+
+    // Returns false once the session should end
+    bool execute(string_view line) {
+        Tokens tokens;
+        tokenize(trim(line), tokens);
+        if (tokens.size() == 0) return true;
+
+        Command command = lookupCommand(tokens[0]);
+        if (command == CMD_QUIT || command == CMD_EXIT) return false;
+        if (tokens.size() > Tokens::MAX_TOKENS) {
+            out << "Invalid\n";
+            return true;
+        }
+
+        switch (command) {
+            case CMD_SU: cmdSu(tokens); break;
+            case CMD_LOGOUT: cmdLogout(tokens); break;
+            case CMD_REGISTER: cmdRegister(tokens); break;
+            case CMD_PASSWD: cmdPasswd(tokens); break;
+            case CMD_USERADD: cmdUseradd(tokens); break;
+            case CMD_DELETE: cmdDelete(tokens); break;
+            case CMD_SHOW: cmdShow(tokens); break;
+            case CMD_BUY: cmdBuy(tokens); break;
+            case CMD_SELECT: cmdSelect(tokens); break;
+            case CMD_MODIFY: cmdModify(tokens); break;
+            case CMD_IMPORT: cmdImport(tokens); break;
+            case CMD_LOG: cmdLog(tokens); break;
+            case CMD_REPORT: cmdReport(tokens); break;
+            case CMD_STATS: cmdStats(tokens); break;
+            default: out << "Invalid\n"; break;
         }
+        return true;
     }
 
-    void cmdSu(const vector<string>& tokens) {
+    void cmdSu(const Tokens& tokens) {
         if (tokens.size() < 2 || tokens.size() > 3) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string userID = tokens[1];
-        string password = tokens.size() == 3 ? tokens[2] : "";
+        string_view userID = tokens[1];
+        string_view password = tokens.size() == 3 ? tokens[2] : string_view();
 
         if (!isValidUserID(userID) || (tokens.size() == 3 && !isValidPassword(password))) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         Account acc;
         if (!accountMgr.findAccount(userID, acc)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         int currentPriv = getCurrentPrivilege();
 
-        if (currentPriv > acc.privilege) {
-            // Can login without password
-            Session sess;
-            sess.userID = userID;
-            sess.privilege = acc.privilege;
-            loginStack.push_back(sess);
-        } else {
+        // Can login without password only to a lower privilege
+        if (currentPriv <= acc.privilege) {
             if (tokens.size() != 3) {
-                cout << "Invalid" << endl;
+                out << "Invalid\n";
                 return;
             }
-            if (string(acc.password) != password) {
-                cout << "Invalid" << endl;
+            if (password != acc.password) {
+                out << "Invalid\n";
                 return;
             }
-            Session sess;
-            sess.userID = userID;
-            sess.privilege = acc.privilege;
-            loginStack.push_back(sess);
         }
+
+        // Logged on behalf of the session that ran su
+        logOperation(CMD_SU, string_view(), 0, Money(), userID);
+        Session sess;
+        sess.userID = userID;
+        sess.privilege = acc.privilege;
+        loginStack.push_back(sess);
     }
 
-    void cmdLogout(const vector<string>& tokens) {
+    void cmdLogout(const Tokens& tokens) {
         if (tokens.size() != 1) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 1) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (loginStack.empty()) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
+        logOperation(CMD_LOGOUT);
         loginStack.pop_back();
     }
 
-    void cmdRegister(const vector<string>& tokens) {
+    void cmdRegister(const Tokens& tokens) {
         if (tokens.size() != 4) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string userID = tokens[1];
-        string password = tokens[2];
-        string username = tokens[3];
+        string_view userID = tokens[1];
+        string_view password = tokens[2];
+        string_view username = tokens[3];
 
         if (!isValidUserID(userID) || !isValidPassword(password) || !isValidUsername(username)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         Account existing;
         if (accountMgr.findAccount(userID, existing)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         Account acc;
-        strcpy(acc.userID, userID.c_str());
-        strcpy(acc.password, password.c_str());
+        copyField(acc.userID, userID);
+        copyField(acc.password, password);
         acc.privilege = 1;
-        strcpy(acc.username, username.c_str());
+        copyField(acc.username, username);
 
         accountMgr.addAccount(acc);
+        logOperation(CMD_REGISTER, string_view(), 0, Money(), userID);
     }
 
-    void cmdPasswd(const vector<string>& tokens) {
+    void cmdPasswd(const Tokens& tokens) {
         if (tokens.size() < 3 || tokens.size() > 4) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 1) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string userID = tokens[1];
-        string currentPassword = tokens.size() == 4 ? tokens[2] : "";
-        string newPassword = tokens.size() == 4 ? tokens[3] : tokens[2];
+        string_view userID = tokens[1];
+        string_view currentPassword = tokens.size() == 4 ? tokens[2] : string_view();
+        string_view newPassword = tokens.size() == 4 ? tokens[3] : tokens[2];
 
         if (!isValidUserID(userID) || !isValidPassword(newPassword)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (tokens.size() == 4 && !isValidPassword(currentPassword)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         Account acc;
         if (!accountMgr.findAccount(userID, acc)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
@@ -649,554 +3214,533 @@ public:
             accountMgr.updatePassword(userID, newPassword);
         } else {
             if (tokens.size() != 4) {
-                cout << "Invalid" << endl;
+                out << "Invalid\n";
                 return;
             }
-            if (string(acc.password) != currentPassword) {
-                cout << "Invalid" << endl;
+            if (currentPassword != acc.password) {
+                out << "Invalid\n";
                 return;
             }
             accountMgr.updatePassword(userID, newPassword);
         }
+        logOperation(CMD_PASSWD, string_view(), 0, Money(), userID);
     }
 
-    void cmdUseradd(const vector<string>& tokens) {
+    void cmdUseradd(const Tokens& tokens) {
         if (tokens.size() != 5) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 3) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string userID = tokens[1];
-        string password = tokens[2];
-        string privilegeStr = tokens[3];
-        string username = tokens[4];
+        string_view userID = tokens[1];
+        string_view password = tokens[2];
+        string_view privilegeStr = tokens[3];
+        string_view username = tokens[4];
 
         if (!isValidUserID(userID) || !isValidPassword(password) || !isValidUsername(username)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (privilegeStr.length() != 1 || !isdigit(privilegeStr[0])) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         int privilege = privilegeStr[0] - '0';
         if (privilege != 1 && privilege != 3 && privilege != 7) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (privilege >= getCurrentPrivilege()) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         Account existing;
         if (accountMgr.findAccount(userID, existing)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         Account acc;
-        strcpy(acc.userID, userID.c_str());
-        strcpy(acc.password, password.c_str());
+        copyField(acc.userID, userID);
+        copyField(acc.password, password);
         acc.privilege = privilege;
-        strcpy(acc.username, username.c_str());
+        copyField(acc.username, username);
 
         accountMgr.addAccount(acc);
+        logOperation(CMD_USERADD, string_view(), 0, Money(), userID, privilege);
     }
 
-    void cmdDelete(const vector<string>& tokens) {
+    void cmdDelete(const Tokens& tokens) {
         if (tokens.size() != 2) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 7) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string userID = tokens[1];
+        string_view userID = tokens[1];
 
         if (!isValidUserID(userID)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         // Check if account is logged in
         for (const auto& sess : loginStack) {
             if (sess.userID == userID) {
-                cout << "Invalid" << endl;
+                out << "Invalid\n";
                 return;
             }
         }
 
         if (!accountMgr.deleteAccount(userID)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
+            return;
         }
+        logOperation(CMD_DELETE, string_view(), 0, Money(), userID);
     }
 
-    void cmdShow(const vector<string>& tokens) {
+    void cmdShow(const Tokens& tokens) {
         if (tokens.size() == 1) {
             // show all books
             if (getCurrentPrivilege() < 1) {
-                cout << "Invalid" << endl;
+                out << "Invalid\n";
                 return;
             }
 
-            vector<Book> books = bookMgr.getAllBooks();
-            sort(books.begin(), books.end(), [](const Book& a, const Book& b) {
-                return string(a.ISBN) < string(b.ISBN);
-            });
-
-            if (books.empty()) {
-                cout << endl;
-            } else {
-                for (const auto& book : books) {
-                    cout << book.ISBN << "\t" << book.name << "\t" << book.author << "\t"
-                         << book.keyword << "\t" << fixed << setprecision(2) << book.price << "\t"
-                         << book.quantity << endl;
-                }
+            bool empty = true;
+            for (auto cursor = bookMgr.scanAll(); cursor.valid(); cursor.next()) {
+                printBook(cursor.book());
+                empty = false;
+            }
+            if (empty) {
+                out << '\n';
             }
         } else if (tokens.size() == 2 && tokens[1] == "finance") {
             // show finance
             if (getCurrentPrivilege() < 7) {
-                cout << "Invalid" << endl;
+                out << "Invalid\n";
                 return;
             }
 
-            vector<Transaction> transactions = transMgr.getTransactions();
-            double income = 0.0, expenditure = 0.0;
+            Money income, expenditure;
+            transMgr.getTotals(transMgr.size(), income, expenditure);
 
-            for (const auto& trans : transactions) {
-                if (trans.type == 1) {
-                    income += trans.amount;
-                } else {
-                    expenditure += trans.amount;
-                }
-            }
-
-            cout << "+ " << fixed << setprecision(2) << income << " - " << expenditure << endl;
+            out << "+ " << income << " - " << expenditure << '\n';
         } else if (tokens.size() == 3 && tokens[1] == "finance") {
             // show finance [count]
             if (getCurrentPrivilege() < 7) {
-                cout << "Invalid" << endl;
+                out << "Invalid\n";
                 return;
             }
 
             if (!isValidQuantity(tokens[2])) {
-                cout << "Invalid" << endl;
+                out << "Invalid\n";
                 return;
             }
 
             long long count = parseQuantity(tokens[2]);
-            vector<Transaction> transactions = transMgr.getTransactions();
-
-            if (count > (long long)transactions.size()) {
-                cout << "Invalid" << endl;
+            if (count > transMgr.size()) {
+                out << "Invalid\n";
                 return;
             }
 
             if (count == 0) {
-                cout << endl;
+                out << '\n';
                 return;
             }
 
-            double income = 0.0, expenditure = 0.0;
-            long long start = transactions.size() - count;
-            for (long long i = start; i < (long long)transactions.size(); i++) {
-                if (transactions[i].type == 1) {
-                    income += transactions[i].amount;
-                } else {
-                    expenditure += transactions[i].amount;
-                }
-            }
+            Money income, expenditure;
+            transMgr.getTotals(count, income, expenditure);
 
-            cout << "+ " << fixed << setprecision(2) << income << " - " << expenditure << endl;
+            out << "+ " << income << " - " << expenditure << '\n';
         } else if (tokens.size() == 2) {
             // show with filter
             if (getCurrentPrivilege() < 1) {
-                cout << "Invalid" << endl;
+                out << "Invalid\n";
                 return;
             }
 
-            string filter = tokens[1];
-            vector<Book> books;
-
-            if (filter.find("-ISBN=") == 0) {
-                string isbn = filter.substr(6);
-                if (!isValidISBN(isbn)) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                books = bookMgr.searchByISBN(isbn);
-            } else if (filter.find("-name=\"") == 0 && filter.back() == '"') {
-                string name = filter.substr(7, filter.length() - 8);
-                if (!isValidBookString(name)) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                books = bookMgr.searchByName(name);
-            } else if (filter.find("-author=\"") == 0 && filter.back() == '"') {
-                string author = filter.substr(9, filter.length() - 10);
-                if (!isValidBookString(author)) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                books = bookMgr.searchByAuthor(author);
-            } else if (filter.find("-keyword=\"") == 0 && filter.back() == '"') {
-                string keyword = filter.substr(10, filter.length() - 11);
-                if (!isValidBookString(keyword)) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                if (keyword.find('|') != string::npos) {
-                    cout << "Invalid" << endl;
+            string_view value;
+            bool empty = true;
+            auto print = [this, &empty](const Book& book) {
+                printBook(book);
+                empty = false;
+            };
+
+            switch (classifyParam(tokens[1], value)) {
+                case PARAM_ISBN:
+                    if (!isValidISBN(value)) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    bookMgr.searchByISBN(value, print);
+                    break;
+                case PARAM_NAME:
+                    if (!isValidBookString(value)) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    bookMgr.searchByName(value, print);
+                    break;
+                case PARAM_AUTHOR:
+                    if (!isValidBookString(value)) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    bookMgr.searchByAuthor(value, print);
+                    break;
+                case PARAM_KEYWORD:
+                    if (!isValidBookString(value) || value.find('|') != string_view::npos) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    bookMgr.searchByKeyword(value, print);
+                    break;
+                default:
+                    out << "Invalid\n";
                     return;
-                }
-                books = bookMgr.searchByKeyword(keyword);
-            } else {
-                cout << "Invalid" << endl;
-                return;
             }
 
-            sort(books.begin(), books.end(), [](const Book& a, const Book& b) {
-                return string(a.ISBN) < string(b.ISBN);
-            });
-
-            if (books.empty()) {
-                cout << endl;
-            } else {
-                for (const auto& book : books) {
-                    cout << book.ISBN << "\t" << book.name << "\t" << book.author << "\t"
-                         << book.keyword << "\t" << fixed << setprecision(2) << book.price << "\t"
-                         << book.quantity << endl;
-                }
+            if (empty) {
+                out << '\n';
             }
         } else {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
         }
     }
 
-    void cmdBuy(const vector<string>& tokens) {
+    void cmdBuy(const Tokens& tokens) {
         if (tokens.size() != 3) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 1) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string isbn = tokens[1];
-        string quantityStr = tokens[2];
+        string_view isbn = tokens[1];
+        string_view quantityStr = tokens[2];
 
         if (!isValidISBN(isbn) || !isValidQuantity(quantityStr)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         long long quantity = parseQuantity(quantityStr);
         if (quantity <= 0) {
-            cout << "Invalid" << endl;
-            return;
-        }
-
-        Book book;
-        if (!bookMgr.findBook(isbn, book)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        if (book.quantity < quantity) {
-            cout << "Invalid" << endl;
+        // A total too large for Money is rejected like any other invalid
+        // purchase, before the stock changes
+        int handle = bookMgr.locate(isbn);
+        Money totalCost;
+        if (handle < 0 || !bookMgr.getPrice(handle).times(quantity, totalCost) ||
+            !bookMgr.addQuantity(handle, -quantity)) {
+            out << "Invalid\n";
             return;
         }
 
-        double totalCost = book.price * quantity;
-        book.quantity -= quantity;
-        bookMgr.addOrUpdateBook(book);
-
-        transMgr.addTransaction(totalCost, 1);
+        transMgr.addTransaction(totalCost, 1, handle, quantity);
+        logOperation(CMD_BUY, isbn, quantity, totalCost);
 
-        cout << fixed << setprecision(2) << totalCost << endl;
+        out << totalCost << '\n';
     }
 
-    void cmdSelect(const vector<string>& tokens) {
+    void cmdSelect(const Tokens& tokens) {
         if (tokens.size() != 2) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 3) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string isbn = tokens[1];
+        string_view isbn = tokens[1];
 
         if (!isValidISBN(isbn)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        Book book;
-        if (!bookMgr.findBook(isbn, book)) {
+        int handle = bookMgr.locate(isbn);
+        if (handle < 0) {
             // Create new book
             Book newBook;
-            strcpy(newBook.ISBN, isbn.c_str());
-            bookMgr.addOrUpdateBook(newBook);
+            copyField(newBook.ISBN, isbn);
+            handle = bookMgr.addBook(newBook);
         }
 
-        getCurrentSelectedISBN() = isbn;
+        getCurrentSelectedBook() = handle;
+        logOperation(CMD_SELECT, isbn);
     }
 
-    void cmdModify(const vector<string>& tokens) {
+    void cmdModify(const Tokens& tokens) {
         if (tokens.size() < 2) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 3) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string& selectedISBN = getCurrentSelectedISBN();
-        if (selectedISBN.empty()) {
-            cout << "Invalid" << endl;
+        int handle = getCurrentSelectedBook();
+        if (handle < 0) {
+            out << "Invalid\n";
             return;
         }
 
         Book book;
-        if (!bookMgr.findBook(selectedISBN, book)) {
-            cout << "Invalid" << endl;
-            return;
-        }
+        bookMgr.read(handle, book);
 
-        set<string> usedParams;
-        string newISBN = "";
+        int usedParams = 0;
 
         for (size_t i = 1; i < tokens.size(); i++) {
-            string param = tokens[i];
-
-            if (param.find("-ISBN=") == 0) {
-                if (usedParams.count("ISBN")) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                usedParams.insert("ISBN");
-
-                newISBN = param.substr(6);
-                if (!isValidISBN(newISBN) || newISBN.empty()) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-
-                if (newISBN == string(book.ISBN)) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-
-                Book existing;
-                if (bookMgr.findBook(newISBN, existing)) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-            } else if (param.find("-name=\"") == 0 && param.back() == '"') {
-                if (usedParams.count("name")) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                usedParams.insert("name");
-
-                string name = param.substr(7, param.length() - 8);
-                if (!isValidBookString(name) || name.empty()) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                strcpy(book.name, name.c_str());
-            } else if (param.find("-author=\"") == 0 && param.back() == '"') {
-                if (usedParams.count("author")) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                usedParams.insert("author");
-
-                string author = param.substr(9, param.length() - 10);
-                if (!isValidBookString(author) || author.empty()) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                strcpy(book.author, author.c_str());
-            } else if (param.find("-keyword=\"") == 0 && param.back() == '"') {
-                if (usedParams.count("keyword")) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                usedParams.insert("keyword");
-
-                string keyword = param.substr(10, param.length() - 11);
-                if (!isValidKeyword(keyword) || keyword.empty()) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                strcpy(book.keyword, keyword.c_str());
-            } else if (param.find("-price=") == 0) {
-                if (usedParams.count("price")) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                usedParams.insert("price");
-
-                string priceStr = param.substr(7);
-                if (!isValidPrice(priceStr) || priceStr.empty()) {
-                    cout << "Invalid" << endl;
-                    return;
-                }
-                book.price = parsePrice(priceStr);
-            } else {
-                cout << "Invalid" << endl;
+            string_view value;
+            ParamKind kind = classifyParam(tokens[i], value);
+            if (kind == PARAM_INVALID || (usedParams & kind)) {
+                out << "Invalid\n";
                 return;
             }
-        }
-
-        if (!newISBN.empty()) {
-            // Delete old book and create new one
-            vector<Book> books = bookMgr.getAllBooks();
-            vector<Book> updatedBooks;
-
-            for (const auto& b : books) {
-                if (string(b.ISBN) != string(book.ISBN)) {
-                    updatedBooks.push_back(b);
+            usedParams |= kind;
+
+            switch (kind) {
+                case PARAM_ISBN: {
+                    if (!isValidISBN(value) || value == book.ISBN) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    if (bookMgr.locate(value) >= 0) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    copyField(book.ISBN, value);
+                    break;
                 }
+                case PARAM_NAME:
+                    if (!isValidBookString(value)) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    copyField(book.name, value);
+                    break;
+                case PARAM_AUTHOR:
+                    if (!isValidBookString(value)) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    copyField(book.author, value);
+                    break;
+                case PARAM_KEYWORD:
+                    if (!isValidKeyword(value)) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    copyField(book.keyword, value);
+                    break;
+                default:
+                    if (!isValidPrice(value)) {
+                        out << "Invalid\n";
+                        return;
+                    }
+                    book.price = parsePrice(value);
+                    break;
             }
-
-            strcpy(book.ISBN, newISBN.c_str());
-            updatedBooks.push_back(book);
-
-            ofstream outFile("books.dat", ios::binary | ios::trunc);
-            for (const auto& bk : updatedBooks) {
-                outFile.write(reinterpret_cast<const char*>(&bk), sizeof(Book));
-            }
-            outFile.close();
-
-            selectedISBN = newISBN;
-        } else {
-            bookMgr.addOrUpdateBook(book);
         }
+
+        bookMgr.updateBook(handle, book);
+        logOperation(CMD_MODIFY, string_view(book.ISBN));
     }
 
-    void cmdImport(const vector<string>& tokens) {
+    void cmdImport(const Tokens& tokens) {
         if (tokens.size() != 3) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 3) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        string& selectedISBN = getCurrentSelectedISBN();
-        if (selectedISBN.empty()) {
-            cout << "Invalid" << endl;
+        int handle = getCurrentSelectedBook();
+        if (handle < 0) {
+            out << "Invalid\n";
             return;
         }
 
-        string quantityStr = tokens[1];
-        string costStr = tokens[2];
+        string_view quantityStr = tokens[1];
+        string_view costStr = tokens[2];
 
         if (!isValidQuantity(quantityStr) || !isValidPrice(costStr)) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         long long quantity = parseQuantity(quantityStr);
-        double cost = parsePrice(costStr);
+        Money cost = parsePrice(costStr);
 
-        if (quantity <= 0 || cost <= 0) {
-            cout << "Invalid" << endl;
+        if (quantity <= 0 || cost.cents <= 0) {
+            out << "Invalid\n";
             return;
         }
 
-        Book book;
-        if (!bookMgr.findBook(selectedISBN, book)) {
-            cout << "Invalid" << endl;
-            return;
-        }
-
-        book.quantity += quantity;
-        bookMgr.addOrUpdateBook(book);
+        bookMgr.addQuantity(handle, quantity);
 
-        transMgr.addTransaction(cost, -1);
+        transMgr.addTransaction(cost, -1, handle, quantity);
+        FixedString<21> isbn = bookMgr.getISBN(handle);
+        logOperation(CMD_IMPORT, string_view(isbn.data), quantity, cost);
     }
 
-    void cmdLog(const vector<string>& tokens) {
+    void cmdLog(const Tokens& tokens) {
         if (tokens.size() != 1) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 7) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
-        vector<string> logs = logMgr.getLogs();
-        for (const auto& log : logs) {
-            cout << log << endl;
+        OpRecord op;
+        for (int i = 0; i < logMgr.size(); i++) {
+            logMgr.read(i, op);
+            printOperation(op);
         }
     }
 
-    void cmdReport(const vector<string>& tokens) {
+    // One log line, e.g. "[42] employee_07 {3} import 978-0000000042 x100 cost 1234.50"
+    void printOperation(const OpRecord& op) {
+        out << '[' << op.sequence << "] " << (op.userID[0] ? op.userID : "-") << " {" << op.privilege
+            << "} " << commandName((Command)op.opcode);
+        if (op.target[0]) out << ' ' << op.target;
+        if (op.opcode == CMD_USERADD) out << " {" << op.grantedPrivilege << '}';
+        if (op.ISBN[0]) out << ' ' << op.ISBN;
+        if (op.opcode == CMD_BUY || op.opcode == CMD_IMPORT) {
+            out << " x" << op.quantity << (op.opcode == CMD_BUY ? " income " : " cost ") << op.amount;
+        }
+        out << '\n';
+    }
+
+    // Per-book and store-wide sales and imports, read from the maintained
+    // aggregates
+    void printFinanceReport() {
+        out << "Financial Report:\n";
+        bookMgr.forEachBook([this](const FixedString<21>& isbn, int handle) {
+            FinanceRecord record = transMgr.getBookTotals(handle);
+            if (record.unitsSold == 0 && record.unitsImported == 0) return;
+            out << isbn.data << "\tsold " << record.unitsSold << " income " << record.revenue
+                << "\timported " << record.unitsImported << " cost " << record.importCost << '\n';
+        });
+        FinanceRecord totals = transMgr.getTotals();
+        out << "Total\tsold " << totals.unitsSold << " income " << totals.revenue << "\timported "
+            << totals.unitsImported << " cost " << totals.importCost << "\tprofit "
+            << totals.revenue - totals.importCost << '\n';
+    }
+
+    // Per-employee totals, gathered by following each employee's own chain
+    // of log entries
+    void printEmployeeReport() {
+        out << "Employee Report:\n";
+        logMgr.forEachStaff([this](const FixedString<31>& userID, int latest) {
+            OpRecord op;
+            long long counts[COMMAND_COUNT] = {};
+            long long imported = 0, sold = 0;
+            Money cost, income;
+            for (int i = latest; i != -1; i = op.previousByUser) {
+                logMgr.read(i, op);
+                if (op.opcode < 0 || op.opcode >= COMMAND_COUNT) continue; // corrupt entry
+                counts[op.opcode]++;
+                if (op.opcode == CMD_IMPORT) {
+                    imported += op.quantity;
+                    cost += op.amount;
+                } else if (op.opcode == CMD_BUY) {
+                    sold += op.quantity;
+                    income += op.amount;
+                }
+            }
+
+            out << userID.data;
+            for (Command command : {CMD_SU, CMD_LOGOUT, CMD_REGISTER, CMD_PASSWD, CMD_USERADD, CMD_DELETE, CMD_SELECT,
+                                    CMD_MODIFY, CMD_IMPORT, CMD_BUY}) {
+                if (counts[command] == 0) continue;
+                out << '\t' << commandName(command) << ' ' << counts[command];
+            }
+            if (imported > 0) out << "\timported " << imported << " cost " << cost;
+            if (sold > 0) out << "\tsold " << sold << " income " << income;
+            out << '\n';
+        });
+    }
+
+    void cmdReport(const Tokens& tokens) {
         if (tokens.size() != 2) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (getCurrentPrivilege() < 7) {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
             return;
         }
 
         if (tokens[1] == "finance") {
-            cout << "Financial Report:" << endl;
-            vector<Transaction> transactions = transMgr.getTransactions();
-            for (size_t i = 0; i < transactions.size(); i++) {
-                if (transactions[i].type == 1) {
-                    cout << "Income: " << fixed << setprecision(2) << transactions[i].amount << endl;
-                } else {
-                    cout << "Expenditure: " << fixed << setprecision(2) << transactions[i].amount << endl;
-                }
-            }
+            printFinanceReport();
         } else if (tokens[1] == "employee") {
-            cout << "Employee Report:" << endl;
-            vector<string> logs = logMgr.getLogs();
-            for (const auto& log : logs) {
-                cout << log << endl;
-            }
+            printEmployeeReport();
         } else {
-            cout << "Invalid" << endl;
+            out << "Invalid\n";
+        }
+    }
+
+    // Prints the per-command statistics gathered so far, or a note that
+    // BOOKSTORE_STATS is not set
+    void cmdStats(const Tokens& tokens) {
+        if (tokens.size() != 1 || getCurrentPrivilege() < 7) {
+            out << "Invalid\n";
+            return;
+        }
+        if (!stats.isEnabled()) {
+            out << "statistics disabled; set BOOKSTORE_STATS to enable\n";
+            return;
         }
+        out << stats.summary();
     }
 };
 
+#ifndef BOOKSTORE_NO_MAIN
 int main() {
     BookstoreSystem system;
-    string line;
-
-    while (getline(cin, line)) {
-        system.processCommand(line);
+    InputReader input;
+    string_view line;
+    // A person at a terminal needs each response before typing the next line
+    bool interactive = isatty(STDIN_FILENO);
+
+    while (input.next(line)) {
+        if (!system.processCommand(line)) break;
+        if (interactive) system.flushOutput();
     }
 
     return 0;
 }
+#endif